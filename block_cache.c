@@ -0,0 +1,859 @@
+/* block_cache.c
+ *
+ * Write-back buffer cache sitting between sfs.c and disk_emu.c.
+ * Frames are indexed by a hash on the disk block number and kept on an LRU list,
+ * dirty frames only reach the disk when they are evicted or on cache_sync().
+ * Held frames (metadata waiting for its journal commit) are not written back until cache_release(),
+ * not even when every frame is held : other blocks then bypass the cache and cache_write_held() fails.
+ * Every call takes cache_lock, reads of missing blocks are done outside of it. The file system locks
+ * keep a block from being written by one thread while another one reads it.
+ * cache_prefetch() reads blocks ahead into buffers of their own, they are cached once the read is
+ * complete. A read missing a block that is being prefetched waits for it instead of reading it again,
+ * a block written meanwhile makes the prefetch stale and what it read is thrown away.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "disk_emu.h"
+#include "block_cache.h"
+
+#define CACHE_MAX_RUN           64      //max number of blocks written back in one write_blocks call
+#define CACHE_AIO_CHUNK         16      //max number of blocks per request of a batch, so a long run keeps several in flight
+#define CACHE_PREFETCH_MAX      16      //prefetch requests in flight, more are not issued until some complete
+
+//cache frame structure definition
+typedef struct _cache_frame_t{
+    int blk;        //disk block held by this frame, -1 if unused
+    int dirty;      //1 if the frame differs from the disk
+    int held;       //1 if the frame must not reach the disk before cache_release()
+    int prev;       //LRU list, towards most recently used (-1 at the head)
+    int next;       //LRU list, towards least recently used (-1 at the tail)
+    int hnext;      //next frame in the same hash bucket (-1 at the end)
+}cache_frame_t;
+
+//prefetch request in flight
+typedef struct _cache_prefetch_t{
+    disk_aio_t aio;     //reads into a buffer of its own
+    int submitted;      //1 once handed to the disk, it can then be waited for
+    int ready;          //1 once the read is done (set by the disk thread under cache_pf_lock)
+    int stale;          //1 if a block it covers was written or dropped meanwhile, what it read is discarded
+    int users;          //threads waiting for it outside cache_lock
+    int listed;         //1 while in cache_pf
+}cache_prefetch_t;
+
+//GLOBAL VARIABLES
+cache_frame_t *cache_frames = NULL;     //frame descriptors
+char *cache_data = NULL;                //frame contents, nframes*block_size bytes
+char *cache_run_buf = NULL;             //staging buffer used to coalesce write backs
+int *cache_buckets = NULL;              //hash buckets (first frame index, -1 if empty)
+int cache_nframes = 0;
+int cache_nbuckets = 0;                 //power of 2
+int cache_blk_size = 0;
+int lru_head = -1;                      //most recently used frame
+int lru_tail = -1;                      //least recently used frame
+int cache_nheld = 0;                    //number of held frames
+cache_stats_t cache_stats;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;    //frames, hash, LRU list and counters
+cache_prefetch_t *cache_pf[CACHE_PREFETCH_MAX];             //prefetches in flight
+int cache_npf = 0;
+pthread_mutex_t cache_pf_lock = PTHREAD_MUTEX_INITIALIZER; //ready flags of the prefetches
+
+//helper functions
+
+//returns hash bucket of a disk block
+static int cache_hash(int blk){
+    return (int)(((unsigned int)blk * 2654435761u) & (unsigned int)(cache_nbuckets - 1));
+}
+
+//returns pointer to the contents of a frame
+static char *frame_data(int f){
+    return cache_data + (long)f * cache_blk_size;
+}
+
+//remove frame from the LRU list
+static void lru_unlink(int f){
+    cache_frame_t *fr = &cache_frames[f];
+    if (fr->prev >= 0){
+        cache_frames[fr->prev].next = fr->next;
+    }else{
+        lru_head = fr->next;
+    }
+    if (fr->next >= 0){
+        cache_frames[fr->next].prev = fr->prev;
+    }else{
+        lru_tail = fr->prev;
+    }
+    fr->prev = -1;
+    fr->next = -1;
+}
+
+//insert frame at the most recently used end of the LRU list
+static void lru_push_front(int f){
+    cache_frame_t *fr = &cache_frames[f];
+    fr->prev = -1;
+    fr->next = lru_head;
+    if (lru_head >= 0){
+        cache_frames[lru_head].prev = f;
+    }
+    lru_head = f;
+    if (lru_tail < 0){
+        lru_tail = f;
+    }
+}
+
+//insert frame at the least recently used end of the LRU list, to be reused first
+static void lru_push_back(int f){
+    cache_frame_t *fr = &cache_frames[f];
+    fr->prev = lru_tail;
+    fr->next = -1;
+    if (lru_tail >= 0){
+        cache_frames[lru_tail].next = f;
+    }
+    lru_tail = f;
+    if (lru_head < 0){
+        lru_head = f;
+    }
+}
+
+//returns frame holding blk, -1 if not cached
+static int cache_lookup(int blk){
+    for (int f = cache_buckets[cache_hash(blk)]; f >= 0; f = cache_frames[f].hnext){
+        if (cache_frames[f].blk == blk){
+            return f;
+        }
+    }
+    return -1;
+}
+
+//remove frame from its hash chain
+static void hash_remove(int f){
+    int *link = &cache_buckets[cache_hash(cache_frames[f].blk)];
+    while (*link >= 0){
+        if (*link == f){
+            *link = cache_frames[f].hnext;
+            break;
+        }
+        link = &cache_frames[*link].hnext;
+    }
+    cache_frames[f].hnext = -1;
+}
+
+//write back the run of contiguous dirty frames containing frame f with a single write_blocks
+//they are only marked clean once it succeeded, returns -1 (all of them still dirty) otherwise
+static int writeback_run(int f){
+    int first = cache_frames[f].blk;
+    int n = 0;
+
+    //walk backwards to the start of the dirty run
+    while (first > 0 && n < CACHE_MAX_RUN - 1){
+        int g = cache_lookup(first - 1);
+        if (g < 0 || !cache_frames[g].dirty || cache_frames[g].held){
+            break;
+        }
+        first--;
+        n++;
+    }
+    //gather the run going forwards
+    n = 0;
+    while (n < CACHE_MAX_RUN){
+        int g = cache_lookup(first + n);
+        if (g < 0 || !cache_frames[g].dirty || (cache_frames[g].held && g != f)){
+            break;
+        }
+        memcpy(cache_run_buf + (long)n * cache_blk_size, frame_data(g), cache_blk_size);
+        n++;
+    }
+    if (write_blocks(first, n, cache_run_buf) < 0){
+        return -1;
+    }
+    for (int i = 0; i < n; i++){
+        cache_frames[cache_lookup(first + i)].dirty = 0;
+    }
+    cache_stats.writebacks += n;
+    return n;
+}
+
+//drops the cached copy of blk, whatever it holds
+static void cache_drop(int blk){
+    int f = cache_lookup(blk);
+    if (f < 0){
+        return;
+    }
+    hash_remove(f);
+    if (cache_frames[f].held){
+        cache_frames[f].held = 0;
+        cache_nheld--;
+    }
+    cache_frames[f].blk = -1;
+    cache_frames[f].dirty = 0;
+    lru_unlink(f);
+    lru_push_back(f);
+}
+
+//lets every held frame be written back again
+static void release_frames(){
+    for (int f = 0; f < cache_nframes && cache_nheld > 0; f++){
+        if (cache_frames[f].held){
+            cache_frames[f].held = 0;
+            cache_nheld--;
+        }
+    }
+}
+
+//returns a frame that can be assigned to blk, evicting the least recently used one if needed
+//held frames are skipped, and dirty ones that could not be written back (they keep the only copy)
+//-1 if there is none left (held frames must not reach the disk before their commit)
+static int cache_alloc_frame(int blk){
+    int f = lru_tail;
+    while (f >= 0 && (cache_frames[f].held || (cache_frames[f].blk >= 0 && cache_frames[f].dirty && writeback_run(f) < 0))){
+        f = cache_frames[f].prev;
+    }
+    if (f < 0){
+        return -1;
+    }
+    if (cache_frames[f].blk >= 0){  //frame in use, evict it
+        hash_remove(f);
+        cache_stats.evictions++;
+    }
+    lru_unlink(f);
+    cache_frames[f].blk = blk;
+    cache_frames[f].dirty = 0;
+    int b = cache_hash(blk);
+    cache_frames[f].hnext = cache_buckets[b];
+    cache_buckets[b] = f;
+    lru_push_front(f);
+    return f;
+}
+
+//caches the copy of blk that was read from disk outside the lock, unless another thread cached it
+//meanwhile, the cached copy is then the newer one and replaces what was read
+static void cache_install(int blk, char *data){
+    int f = cache_lookup(blk);
+    if (f >= 0){
+        memcpy(data, frame_data(f), cache_blk_size);
+        return;
+    }
+    f = cache_alloc_frame(blk);
+    if (f >= 0){    //otherwise it is simply not cached
+        memcpy(frame_data(f), data, cache_blk_size);
+    }
+}
+
+//completion callback of a prefetch, run by the thread that served or reaped it
+static void pf_done(disk_aio_t *aio){
+    pthread_mutex_lock(&cache_pf_lock);
+    ((cache_prefetch_t *)aio->arg)->ready = 1;
+    pthread_mutex_unlock(&cache_pf_lock);
+}
+
+static int pf_ready(cache_prefetch_t *p){
+    pthread_mutex_lock(&cache_pf_lock);
+    int ready = p->ready;
+    pthread_mutex_unlock(&cache_pf_lock);
+    return ready;
+}
+
+//prefetch covering blk, NULL if none, with any 0 only one that was submitted (and can be waited for)
+static cache_prefetch_t *pf_find(int blk, int any){
+    for (int i = 0; i < cache_npf; i++){
+        cache_prefetch_t *p = cache_pf[i];
+        if ((any || p->submitted) && blk >= p->aio.start_address && blk < p->aio.start_address + p->aio.nblocks){
+            return p;
+        }
+    }
+    return NULL;
+}
+
+//makes the prefetches covering blocks [start, start+n) stale
+static void pf_stale(int start, int n){
+    for (int i = 0; i < cache_npf; i++){
+        cache_prefetch_t *p = cache_pf[i];
+        if (start < p->aio.start_address + p->aio.nblocks && p->aio.start_address < start + n){
+            p->stale = 1;
+        }
+    }
+}
+
+static void pf_unlist(cache_prefetch_t *p){
+    for (int i = 0; i < cache_npf; i++){
+        if (cache_pf[i] == p){
+            cache_pf[i] = cache_pf[--cache_npf];
+            break;
+        }
+    }
+    p->listed = 0;
+}
+
+//caches what a completed prefetch read, unless it is stale, the last thread done with it frees it
+static void pf_complete(cache_prefetch_t *p){
+    if (p->listed){
+        if (!p->stale && p->aio.result >= 0){
+            for (int j = 0; j < p->aio.nblocks; j++){
+                if (cache_lookup(p->aio.start_address + j) < 0){
+                    cache_install(p->aio.start_address + j, (char *)p->aio.buffer + (long)j * cache_blk_size);
+                    cache_stats.prefetched++;
+                }
+            }
+        }
+        pf_unlist(p);
+    }
+    if (p->users == 0){
+        free(p->aio.buffer);
+        free(p);
+    }
+}
+
+//waits for prefetch p outside the lock and caches what it read
+static void pf_wait(cache_prefetch_t *p){
+    p->users++;
+    pthread_mutex_unlock(&cache_lock);
+    wait_blocks(&p->aio);
+    pthread_mutex_lock(&cache_lock);
+    p->users--;
+    pf_complete(p);
+}
+
+//caches the prefetches that are done, or waits for them all
+static void pf_reap(int all){
+    int i = 0;
+    while (i < cache_npf){
+        cache_prefetch_t *p = cache_pf[i];
+        if (!p->submitted || p->users > 0 || (!all && !pf_ready(p))){
+            i++;
+            continue;
+        }
+        pf_wait(p); //done, or about to be marked so
+        i = 0;      //the list changed while the lock was dropped
+    }
+}
+
+//queues every dirty frame that is not held to the disk and runs the queue
+static int sync_frames(){
+    int res = 0;
+    for (int f = 0; f < cache_nframes; f++){
+        if (cache_frames[f].blk >= 0 && cache_frames[f].dirty && !cache_frames[f].held){
+            if (queue_blocks(1, cache_frames[f].blk, 1, frame_data(f)) < 0){
+                res = -1;   //stays dirty
+                continue;
+            }
+            cache_frames[f].dirty = 0;
+            cache_stats.writebacks++;
+        }
+    }
+    if (run_queue() < 0){
+        res = -1;
+    }
+    return res;
+}
+
+
+/*------------------------------------------------------------------*/
+/*Allocates nframes cache frames of block_size bytes, drops old state*/
+/*------------------------------------------------------------------*/
+int cache_init(int block_size, int nframes)
+{
+    register_disk_buffers(NULL, NULL, 0);
+    pthread_mutex_lock(&cache_lock);
+    pf_reap(1);
+    free(cache_frames);
+    free(cache_data);
+    free(cache_run_buf);
+    free(cache_buckets);
+
+    cache_blk_size = block_size;
+    cache_nframes = nframes;
+    cache_nbuckets = 1;
+    while (cache_nbuckets < 2 * nframes){   //keep chains short
+        cache_nbuckets = cache_nbuckets * 2;
+    }
+
+    cache_frames = (cache_frame_t *)malloc(sizeof(cache_frame_t) * nframes);
+    cache_data = (char *)malloc((long)block_size * nframes);
+    cache_run_buf = (char *)malloc((long)block_size * CACHE_MAX_RUN);
+    cache_buckets = (int *)malloc(sizeof(int) * cache_nbuckets);
+    if (cache_frames == NULL || cache_data == NULL || cache_run_buf == NULL || cache_buckets == NULL){
+        printf("Could not allocate block cache\n");
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+
+    for (int b = 0; b < cache_nbuckets; b++){
+        cache_buckets[b] = -1;
+    }
+    lru_head = -1;
+    lru_tail = -1;
+    cache_nheld = 0;
+    for (int f = 0; f < nframes; f++){  //all frames start unused on the LRU list
+        cache_frames[f].blk = -1;
+        cache_frames[f].dirty = 0;
+        cache_frames[f].held = 0;
+        cache_frames[f].hnext = -1;
+        cache_frames[f].prev = -1;
+        cache_frames[f].next = -1;
+        lru_push_front(f);
+    }
+    memset(&cache_stats, 0, sizeof(cache_stats));
+    pthread_mutex_unlock(&cache_lock);
+
+    //frames and the write back buffer are registered with the disk, every transfer goes through them
+    void *bufs[2] = {cache_data, cache_run_buf};
+    size_t lens[2] = {(size_t)block_size * nframes, (size_t)block_size * CACHE_MAX_RUN};
+    register_disk_buffers(bufs, lens, 2);
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks through the cache into the buffer          */
+/*-------------------------------------------------------------------*/
+int cache_read_blocks(int start_address, int nblocks, void *buffer)
+{
+    char *buf = (char *)buffer;
+    int i = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    while (i < nblocks){
+        int f = cache_lookup(start_address + i);
+        if (f >= 0){    //hit, copy out and mark as recently used
+            cache_stats.hits++;
+            memcpy(buf + (long)i * cache_blk_size, frame_data(f), cache_blk_size);
+            lru_unlink(f);
+            lru_push_front(f);
+            i++;
+            continue;
+        }
+        cache_prefetch_t *p = pf_find(start_address + i, 0);
+        if (p != NULL){ //being read ahead, wait for it and look again
+            pf_wait(p);
+            continue;
+        }
+        //miss, read the whole run of missing blocks straight into the caller's buffer
+        int run = 1;
+        while (i + run < nblocks && cache_lookup(start_address + i + run) < 0 && pf_find(start_address + i + run, 0) == NULL){
+            run++;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        int res = read_blocks(start_address + i, run, buf + (long)i * cache_blk_size);
+        pthread_mutex_lock(&cache_lock);
+        if (res < 0){
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        cache_stats.misses += run;
+        for (int j = 0; j < run; j++){  //then install clean copies
+            cache_install(start_address + i + j, buf + (long)(i + j) * cache_blk_size);
+        }
+        i = i + run;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks into the cache, marking them dirty       */
+/*------------------------------------------------------------------*/
+int cache_write_blocks(int start_address, int nblocks, void *buffer)
+{
+    char *buf = (char *)buffer;
+    pthread_mutex_lock(&cache_lock);
+    pf_stale(start_address, nblocks);
+    for (int i = 0; i < nblocks; i++){
+        int f = cache_lookup(start_address + i);
+        if (f >= 0){
+            cache_stats.hits++;
+            lru_unlink(f);
+            lru_push_front(f);
+        }else{  //whole block is overwritten, no need to read it first
+            cache_stats.misses++;
+            f = cache_alloc_frame(start_address + i);
+        }
+        if (f < 0){ //no frame can be reused (held or not written back), the block goes straight to the disk
+            cache_stats.writebacks++;
+            if (write_blocks(start_address + i, 1, buf + (long)i * cache_blk_size) < 0){
+                pthread_mutex_unlock(&cache_lock);
+                return -1;
+            }
+            continue;
+        }
+        memcpy(frame_data(f), buf + (long)i * cache_blk_size, cache_blk_size);
+        cache_frames[f].dirty = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes len bytes at offset off of block blk into the cache and     */
+/*holds it, the block being read first if it is not cached. Returns  */
+/*-1 if it cannot be cached, every frame being held                  */
+/*------------------------------------------------------------------*/
+int cache_write_held(int blk, int off, int len, const void *bytes)
+{
+    pthread_mutex_lock(&cache_lock);
+    pf_stale(blk, 1);
+    int f = cache_lookup(blk);
+    if (f >= 0){
+        cache_stats.hits++;
+        lru_unlink(f);
+        lru_push_front(f);
+    }else{
+        cache_stats.misses++;
+        f = cache_alloc_frame(blk);
+        if (f < 0){
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+        if ((off > 0 || len < cache_blk_size) && read_blocks(blk, 1, frame_data(f)) < 0){
+            cache_drop(blk);
+            pthread_mutex_unlock(&cache_lock);
+            return -1;
+        }
+    }
+    memcpy(frame_data(f) + off, bytes, len);
+    cache_frames[f].dirty = 1;
+    if (!cache_frames[f].held){
+        cache_frames[f].held = 1;
+        cache_nheld++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return len;
+}
+
+//adds the requests of a batch for blocks [start, start+nblocks) of buffer, split in chunks
+static int batch_add(disk_aio_t *aio, disk_aio_t **reqs, int n, int write, int start, int nblocks, char *buffer){
+    for (int i = 0; i < nblocks; i = i + CACHE_AIO_CHUNK){
+        disk_aio_t *a = &aio[n];
+        memset(a, 0, sizeof(disk_aio_t));
+        a->write = write;
+        a->start_address = start + i;
+        a->nblocks = nblocks - i < CACHE_AIO_CHUNK ? nblocks - i : CACHE_AIO_CHUNK;
+        a->buffer = buffer + (long)i * cache_blk_size;
+        reqs[n] = a;
+        n++;
+    }
+    return n;
+}
+
+//number of requests batch_add can make for a batch, reading a run is split at every cached block
+static int batch_max(cache_io_t *io, int n, int write){
+    int max = 0;
+    for (int i = 0; i < n; i++){
+        max = max + (write ? (io[i].nblocks + CACHE_AIO_CHUNK - 1) / CACHE_AIO_CHUNK : io[i].nblocks);
+    }
+    return max;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads a batch of runs of blocks, each into its own buffer. Cached  */
+/*blocks are copied and the missing ones are read with requests kept */
+/*in flight together, then cached                                    */
+/*------------------------------------------------------------------*/
+int cache_read_batch(cache_io_t *io, int n)
+{
+    int max = batch_max(io, n, 0);
+    disk_aio_t *aio = (disk_aio_t *)malloc(sizeof(disk_aio_t) * (max + 1));
+    disk_aio_t **reqs = (disk_aio_t **)malloc(sizeof(disk_aio_t *) * (max + 1));
+    if (aio == NULL || reqs == NULL){
+        free(aio);
+        free(reqs);
+        return -1;
+    }
+    int nreqs = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int r = 0; r < n; r++){
+        int i = 0;
+        while (i < io[r].nblocks){
+            int f = cache_lookup(io[r].start_address + i);
+            if (f >= 0){    //hit, copy out and mark as recently used
+                cache_stats.hits++;
+                memcpy(io[r].buffer + (long)i * cache_blk_size, frame_data(f), cache_blk_size);
+                lru_unlink(f);
+                lru_push_front(f);
+                i++;
+                continue;
+            }
+            cache_prefetch_t *p = pf_find(io[r].start_address + i, 0);
+            if (p != NULL){ //being read ahead, wait for it and look again
+                pf_wait(p);
+                continue;
+            }
+            int run = 1;    //missing blocks, read straight into the caller's buffer
+            while (i + run < io[r].nblocks && cache_lookup(io[r].start_address + i + run) < 0
+                && pf_find(io[r].start_address + i + run, 0) == NULL){
+                run++;
+            }
+            nreqs = batch_add(aio, reqs, nreqs, 0, io[r].start_address + i, run, io[r].buffer + (long)i * cache_blk_size);
+            i = i + run;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    int res = 0;
+    if (nreqs > 0 && submit_blocks(reqs, nreqs) < 0){
+        res = -1;
+        nreqs = 0;
+    }
+    for (int q = 0; q < nreqs; q++){
+        if (wait_blocks(reqs[q]) < 0){
+            res = -1;
+        }
+    }
+    pthread_mutex_lock(&cache_lock);
+    for (int q = 0; q < nreqs && res == 0; q++){ //then install clean copies (the same block may be in 2 runs)
+        cache_stats.misses += reqs[q]->nblocks;
+        for (int j = 0; j < reqs[q]->nblocks; j++){
+            cache_install(reqs[q]->start_address + j, (char *)reqs[q]->buffer + (long)j * cache_blk_size);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(aio);
+    free(reqs);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a batch of runs of whole blocks straight to the disk with   */
+/*requests kept in flight together, dropping their cached copies     */
+/*------------------------------------------------------------------*/
+int cache_write_batch(cache_io_t *io, int n)
+{
+    int max = batch_max(io, n, 1);
+    disk_aio_t *aio = (disk_aio_t *)malloc(sizeof(disk_aio_t) * (max + 1));
+    disk_aio_t **reqs = (disk_aio_t **)malloc(sizeof(disk_aio_t *) * (max + 1));
+    if (aio == NULL || reqs == NULL){
+        free(aio);
+        free(reqs);
+        return -1;
+    }
+    int nreqs = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int r = 0; r < n; r++){
+        pf_stale(io[r].start_address, io[r].nblocks);
+        for (int i = 0; i < io[r].nblocks; i++){    //an older dirty copy must not be written back over the new data
+            cache_drop(io[r].start_address + i);
+        }
+        nreqs = batch_add(aio, reqs, nreqs, 1, io[r].start_address, io[r].nblocks, io[r].buffer);
+        cache_stats.writebacks += io[r].nblocks;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    int res = 0;
+    if (nreqs > 0 && submit_blocks(reqs, nreqs) < 0){
+        res = -1;
+        nreqs = 0;
+    }
+    for (int q = 0; q < nreqs; q++){
+        if (wait_blocks(reqs[q]) < 0){
+            res = -1;
+        }
+    }
+    free(aio);
+    free(reqs);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Starts reading blocks [start_address, +nblocks) ahead without      */
+/*waiting, the ones not cached yet are cached once read. Returns the */
+/*number of blocks being prefetched, fewer if too many are in flight */
+/*------------------------------------------------------------------*/
+int cache_prefetch(int start_address, int nblocks)
+{
+    cache_prefetch_t *mine[CACHE_PREFETCH_MAX];
+    disk_aio_t *reqs[CACHE_PREFETCH_MAX];
+    int n = 0;
+    int total = 0;
+    int i = 0;
+
+    pthread_mutex_lock(&cache_lock);
+    pf_reap(0);
+    while (i < nblocks && cache_npf < CACHE_PREFETCH_MAX){
+        if (cache_lookup(start_address + i) >= 0 || pf_find(start_address + i, 1) != NULL){
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < nblocks && run < CACHE_AIO_CHUNK && cache_lookup(start_address + i + run) < 0
+            && pf_find(start_address + i + run, 1) == NULL){
+            run++;
+        }
+        cache_prefetch_t *p = (cache_prefetch_t *)calloc(1, sizeof(cache_prefetch_t));
+        char *buffer = (char *)malloc((long)run * cache_blk_size);
+        if (p == NULL || buffer == NULL){
+            free(p);
+            free(buffer);
+            break;
+        }
+        p->aio.start_address = start_address + i;
+        p->aio.nblocks = run;
+        p->aio.buffer = buffer;
+        p->aio.done = pf_done;
+        p->aio.arg = p;
+        p->listed = 1;
+        cache_pf[cache_npf++] = p;
+        mine[n] = p;
+        reqs[n] = &p->aio;
+        n++;
+        total = total + run;
+        i = i + run;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (n == 0){
+        return 0;
+    }
+    //submitted outside the lock, readers only wait for a prefetch once it is
+    int res = submit_blocks(reqs, n);
+    pthread_mutex_lock(&cache_lock);
+    for (int k = 0; k < n; k++){
+        if (res < 0){
+            pf_unlist(mine[k]);
+            free(mine[k]->aio.buffer);
+            free(mine[k]);
+        }else{
+            mine[k]->submitted = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return res < 0 ? -1 : total;
+}
+
+/*------------------------------------------------------------------*/
+/*Keeps cached blocks from being written back until cache_release()  */
+/*------------------------------------------------------------------*/
+int cache_hold_blocks(int start_address, int nblocks)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < nblocks; i++){
+        int f = cache_lookup(start_address + i);
+        if (f >= 0 && !cache_frames[f].held){
+            cache_frames[f].held = 1;
+            cache_nheld++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Lets every held frame be written back again                        */
+/*------------------------------------------------------------------*/
+void cache_release()
+{
+    pthread_mutex_lock(&cache_lock);
+    release_frames();
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Drops the held frames without writing them back, their transaction */
+/*will never commit. Later reads get the copy on the disk            */
+/*------------------------------------------------------------------*/
+void cache_drop_held()
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int f = 0; f < cache_nframes && cache_nheld > 0; f++){
+        if (cache_frames[f].held){
+            cache_drop(cache_frames[f].blk);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+//returns the number of held frames
+int cache_held(){
+    pthread_mutex_lock(&cache_lock);
+    int n = cache_nheld;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes every dirty frame that is not held back to disk, queued     */
+/*straight from the frames so the disk scheduler orders and merges   */
+/*them                                                               */
+/*------------------------------------------------------------------*/
+int cache_sync()
+{
+    pthread_mutex_lock(&cache_lock);
+    int res = sync_frames();
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes the dirty frames of blocks [start_address, +nblocks) back,  */
+/*so the disk file holds their data for a transfer that bypasses the */
+/*cache. Held frames stay in memory                                  */
+/*------------------------------------------------------------------*/
+int cache_flush_blocks(int start_address, int nblocks)
+{
+    int res = 0;
+    int queued = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < nblocks; i++){
+        int f = cache_lookup(start_address + i);
+        if (f >= 0 && cache_frames[f].dirty && !cache_frames[f].held){
+            if (queue_blocks(1, start_address + i, 1, frame_data(f)) < 0){
+                res = -1;
+            }
+            cache_frames[f].dirty = 0;
+            cache_stats.writebacks++;
+            queued++;
+        }
+    }
+    if (queued > 0 && run_queue() < 0){
+        res = -1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Drops the cached copies of blocks [start_address, +nblocks) after  */
+/*they were written to the disk file directly, dirty or not          */
+/*------------------------------------------------------------------*/
+void cache_invalidate_blocks(int start_address, int nblocks)
+{
+    pthread_mutex_lock(&cache_lock);
+    pf_stale(start_address, nblocks);
+    for (int i = 0; i < nblocks; i++){
+        cache_drop(start_address + i);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes back dirty frames and releases the cache. Frames still held */
+/*belong to a transaction that was never committed and are dropped   */
+/*------------------------------------------------------------------*/
+int cache_close()
+{
+    int res = 0;
+    pthread_mutex_lock(&cache_lock);
+    pf_reap(1);
+    if (cache_frames != NULL){
+        res = sync_frames();
+    }
+    pthread_mutex_unlock(&cache_lock);
+    register_disk_buffers(NULL, NULL, 0);
+    pthread_mutex_lock(&cache_lock);
+    free(cache_frames);
+    free(cache_data);
+    free(cache_run_buf);
+    free(cache_buckets);
+    cache_frames = NULL;
+    cache_data = NULL;
+    cache_run_buf = NULL;
+    cache_buckets = NULL;
+    cache_nframes = 0;
+    lru_head = -1;
+    lru_tail = -1;
+    cache_nheld = 0;
+    pthread_mutex_unlock(&cache_lock);
+    return res;
+}
+
+//copies the hit/miss counters
+void cache_get_stats(cache_stats_t *stats){
+    pthread_mutex_lock(&cache_lock);
+    *stats = cache_stats;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,37 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+//hit/miss counters of the buffer cache
+typedef struct _cache_stats_t{
+    long hits;          //blocks served from a cached frame
+    long misses;        //blocks that had to be read from disk
+    long evictions;     //frames reused for another block
+    long writebacks;    //dirty blocks written back to disk
+    long prefetched;    //blocks read ahead and cached
+}cache_stats_t;
+
+//run of blocks of a batch
+typedef struct _cache_io_t{
+    int start_address;
+    int nblocks;
+    char *buffer;       //nblocks blocks
+}cache_io_t;
+
+int cache_init(int block_size, int nframes);
+int cache_read_blocks(int start_address, int nblocks, void *buffer);
+int cache_write_blocks(int start_address, int nblocks, void *buffer);
+int cache_write_held(int blk, int off, int len, const void *bytes);
+int cache_read_batch(cache_io_t *io, int n);
+int cache_write_batch(cache_io_t *io, int n);
+int cache_prefetch(int start_address, int nblocks);
+int cache_hold_blocks(int start_address, int nblocks);
+void cache_release();
+void cache_drop_held();
+int cache_held();
+int cache_sync();
+int cache_flush_blocks(int start_address, int nblocks);
+void cache_invalidate_blocks(int start_address, int nblocks);
+int cache_close();
+void cache_get_stats(cache_stats_t *stats);
+
+#endif
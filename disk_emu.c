@@ -2,23 +2,531 @@
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE       /*from linux/fs.h, the geometry below uses the name*/
 #include "disk_emu.h"
 
 
+#define DISK_QUEUE_DEPTH        128     //requests waiting in the queue before it is run
+#define DISK_MAX_MERGE          256     //max number of blocks of adjacent requests merged into one
+#define DISK_MAX_WORKERS        64      //max number of threads serving submitted requests
+#define DISK_RING_ENTRIES       256     //submission ring size of the io_uring backend
+#define DISK_MAX_BUFFERS        8       //max number of registered buffers
+
+
+/*io_uring instance, mapped rings and what is registered with it*/
+typedef struct _disk_ring_t
+{
+    int fd;                     /*-1 when not set up, pread/pwrite are used instead*/
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries, cq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    unsigned to_submit;         /*sqes filled but not given to the kernel yet*/
+    unsigned inflight;          /*submitted requests not reaped yet*/
+    int fixed_file;             /*1 if the image is registered as file 0*/
+    int nbufs;                  /*buffers registered, 0 if none*/
+} disk_ring_t;
+
+/*Request waiting in the queue*/
+typedef struct _disk_req_t
+{
+    int write;
+    int start_address;
+    int nblocks;
+    char *buffer;
+    double queued;      /*simulated time it was queued at*/
+} disk_req_t;
+
 FILE* fp = NULL;
-double L, p;
-double r;
+int disk_fd = -1;
+int disk_backend = DISK_BACKEND_PIO;
+char *disk_map = NULL;
+size_t disk_map_len = 0;
+double L, p;            /*latency of every request in microseconds, p is unused*/
+double r;               /*seek time in microseconds per block the head travels*/
+double disk_xfer = 0;   /*transfer time in microseconds per block*/
+int disk_sleep = 0;     /*1 to really wait for the modelled time, otherwise it is only accounted*/
+int disk_head = 0;      /*block after the last one transferred*/
+double disk_clock = 0;  /*simulated time in microseconds*/
+double disk_busy_until = 0; /*simulated time the device is done with the requests issued so far*/
+pthread_mutex_t disk_model_lock = PTHREAD_MUTEX_INITIALIZER;   /*head, clock and counters*/
+pthread_mutex_t disk_stdio_lock = PTHREAD_MUTEX_INITIALIZER;   /*fp, its position is shared*/
+disk_stats_t disk_stats;
+int disk_sched = DISK_SCHED_ELEVATOR;
+double disk_deadline = 500000;  /*simulated microseconds a queued request may wait before it is served first*/
+disk_req_t disk_queue[DISK_QUEUE_DEPTH];    /*in arrival order*/
+int disk_queue_len = 0;
+char *disk_merge_buf = NULL;    /*staging buffer of merged requests*/
+pthread_mutex_t disk_queue_lock = PTHREAD_MUTEX_INITIALIZER;   /*queue and merge buffer*/
+pthread_t disk_workers[DISK_MAX_WORKERS];
+int disk_nworkers = 0;          /*threads running*/
+int disk_want_workers = 4;      /*threads started at the first submit_blocks()*/
+int disk_stop = 0;              /*1 to make the threads exit*/
+pthread_mutex_t disk_aio_lock = PTHREAD_MUTEX_INITIALIZER;     /*submitted list and completion flags*/
+pthread_cond_t disk_aio_ready = PTHREAD_COND_INITIALIZER;      /*a request was submitted*/
+pthread_cond_t disk_aio_done = PTHREAD_COND_INITIALIZER;       /*a request completed*/
+disk_aio_t *disk_aio_head = NULL;   /*submitted requests not taken by a thread yet, in order*/
+disk_aio_t *disk_aio_tail = NULL;
+disk_ring_t disk_ring = { .fd = -1 };
+pthread_mutex_t disk_ring_lock = PTHREAD_MUTEX_INITIALIZER;    /*ring state, requests are pushed and reaped under it*/
+pthread_cond_t disk_ring_reaped = PTHREAD_COND_INITIALIZER;    /*completions were reaped*/
+int disk_ring_reaping = 0;      /*1 while a thread waits in the kernel without the lock*/
+static int ring_reap(int wait);
+static int serve_queue();
+struct iovec disk_bufs[DISK_MAX_BUFFERS];  /*buffers to register with the ring*/
+int disk_nbufs = 0;
 int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
 
+/*----------------------------------------------------------*/
+/*Selects how the disk file is accessed, call before init   */
+/*----------------------------------------------------------*/
+int set_disk_backend(int backend)
+{
+    if (backend != DISK_BACKEND_STDIO && backend != DISK_BACKEND_PIO && backend != DISK_BACKEND_MMAP
+        && backend != DISK_BACKEND_URING)
+    {
+        printf("Unknown disk backend %d\n", backend);
+        return -1;
+    }
+    disk_backend = backend;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Sets the device model : a request costs request_us, plus   */
+/*seek_us per block between the head and its first block,    */
+/*plus xfer_us per block. With sleep the time is really      */
+/*waited, otherwise it only adds up in the disk statistics   */
+/*----------------------------------------------------------*/
+int set_disk_latency(double request_us, double seek_us, double xfer_us, int sleep)
+{
+    if (request_us < 0 || seek_us < 0 || xfer_us < 0)
+    {
+        printf("Disk latencies must not be negative\n");
+        return -1;
+    }
+    L = request_us;
+    r = seek_us;
+    disk_xfer = xfer_us;
+    disk_sleep = sleep;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Selects the order queued requests are served in, a request */
+/*waiting more than deadline_us (simulated) is served first  */
+/*----------------------------------------------------------*/
+int set_disk_scheduler(int sched, double deadline_us)
+{
+    if (sched != DISK_SCHED_FIFO && sched != DISK_SCHED_ELEVATOR)
+    {
+        printf("Unknown disk scheduler %d\n", sched);
+        return -1;
+    }
+    run_queue();
+    disk_sched = sched;
+    disk_deadline = deadline_us;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Registers the buffers with the ring, fixed transfers can   */
+/*then be used for requests that fall inside one of them     */
+/*----------------------------------------------------------*/
+static void ring_register_buffers()
+{
+    if (disk_ring.nbufs > 0)
+    {
+        syscall(__NR_io_uring_register, disk_ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        disk_ring.nbufs = 0;
+    }
+    /*May fail under a low RLIMIT_MEMLOCK, the buffers are then used unregistered*/
+    if (disk_nbufs > 0
+        && syscall(__NR_io_uring_register, disk_ring.fd, IORING_REGISTER_BUFFERS, disk_bufs, disk_nbufs) == 0)
+    {
+        disk_ring.nbufs = disk_nbufs;
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Releases the ring, waiting for what is in flight first     */
+/*----------------------------------------------------------*/
+static void ring_teardown()
+{
+    if (disk_ring.fd < 0)
+    {
+        return;
+    }
+    while (disk_ring.inflight > 0 || disk_ring.to_submit > 0)
+    {
+        if (ring_reap(1) < 0)
+        {
+            break;
+        }
+    }
+    if (disk_ring.cq_ptr != disk_ring.sq_ptr)
+    {
+        munmap(disk_ring.cq_ptr, disk_ring.cq_len);
+    }
+    munmap(disk_ring.sq_ptr, disk_ring.sq_len);
+    munmap(disk_ring.sqes, disk_ring.sq_entries * sizeof(struct io_uring_sqe));
+    close(disk_ring.fd);
+    memset(&disk_ring, 0, sizeof(disk_ring));
+    disk_ring.fd = -1;
+}
+
+/*----------------------------------------------------------*/
+/*Sets up an io_uring for disk_fd with the image registered  */
+/*as file 0, returns -1 if the kernel does not allow it      */
+/*----------------------------------------------------------*/
+static int ring_setup()
+{
+    struct io_uring_params params;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = (int) syscall(__NR_io_uring_setup, DISK_RING_ENTRIES, &params);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    memset(&disk_ring, 0, sizeof(disk_ring));
+    disk_ring.fd = fd;
+    disk_ring.sq_entries = params.sq_entries;
+    disk_ring.cq_entries = params.cq_entries;
+    disk_ring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    disk_ring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        /*Both rings in one mapping*/
+        if (disk_ring.cq_len > disk_ring.sq_len)
+        {
+            disk_ring.sq_len = disk_ring.cq_len;
+        }
+        disk_ring.cq_len = disk_ring.sq_len;
+    }
+    disk_ring.sq_ptr = mmap(NULL, disk_ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (disk_ring.sq_ptr == MAP_FAILED)
+    {
+        close(fd);
+        disk_ring.fd = -1;
+        return -1;
+    }
+    disk_ring.cq_ptr = disk_ring.sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        disk_ring.cq_ptr = mmap(NULL, disk_ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    disk_ring.sqes = (struct io_uring_sqe *) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (disk_ring.cq_ptr == MAP_FAILED || disk_ring.sqes == MAP_FAILED)
+    {
+        if (disk_ring.cq_ptr != MAP_FAILED && disk_ring.cq_ptr != disk_ring.sq_ptr)
+        {
+            munmap(disk_ring.cq_ptr, disk_ring.cq_len);
+        }
+        munmap(disk_ring.sq_ptr, disk_ring.sq_len);
+        close(fd);
+        disk_ring.fd = -1;
+        return -1;
+    }
+    disk_ring.sq_head = (unsigned *) ((char *) disk_ring.sq_ptr + params.sq_off.head);
+    disk_ring.sq_tail = (unsigned *) ((char *) disk_ring.sq_ptr + params.sq_off.tail);
+    disk_ring.sq_mask = (unsigned *) ((char *) disk_ring.sq_ptr + params.sq_off.ring_mask);
+    disk_ring.sq_array = (unsigned *) ((char *) disk_ring.sq_ptr + params.sq_off.array);
+    disk_ring.cq_head = (unsigned *) ((char *) disk_ring.cq_ptr + params.cq_off.head);
+    disk_ring.cq_tail = (unsigned *) ((char *) disk_ring.cq_ptr + params.cq_off.tail);
+    disk_ring.cq_mask = (unsigned *) ((char *) disk_ring.cq_ptr + params.cq_off.ring_mask);
+    disk_ring.cqes = (struct io_uring_cqe *) ((char *) disk_ring.cq_ptr + params.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, &disk_fd, 1) == 0)
+    {
+        disk_ring.fixed_file = 1;
+    }
+    ring_register_buffers();
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Gives the filled sqes to the kernel                        */
+/*----------------------------------------------------------*/
+static int ring_enter()
+{
+    for (;;)
+    {
+        long n = syscall(__NR_io_uring_enter, disk_ring.fd, disk_ring.to_submit, 0, 0, NULL, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("io_uring_enter failed (%d)\n", errno);
+            return -1;
+        }
+        disk_ring.inflight += (unsigned) n;
+        disk_ring.to_submit -= (unsigned) n;
+        return 0;
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Completes the requests the kernel is done with, first      */
+/*waiting for one with wait. The wait lets go of the lock,   */
+/*so other threads push and submit requests meanwhile        */
+/*----------------------------------------------------------*/
+static int ring_reap(int wait)
+{
+    if (disk_ring_reaping)
+    {
+        /*Another thread waits in the kernel and reaps for all, taking its completions could leave it waiting*/
+        if (wait)
+        {
+            pthread_cond_wait(&disk_ring_reaped, &disk_ring_lock);
+        }
+        return 0;
+    }
+    if (wait && *disk_ring.cq_head == __atomic_load_n(disk_ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if (disk_ring.to_submit > 0 && ring_enter() < 0)
+        {
+            return -1;
+        }
+        disk_ring_reaping = 1;
+        pthread_mutex_unlock(&disk_ring_lock);
+        long n = syscall(__NR_io_uring_enter, disk_ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        int err = errno;
+        pthread_mutex_lock(&disk_ring_lock);
+        disk_ring_reaping = 0;
+        if (n < 0 && err != EINTR)
+        {
+            printf("io_uring_enter failed (%d)\n", err);
+            pthread_cond_broadcast(&disk_ring_reaped);
+            return -1;
+        }
+    }
+
+    unsigned head = *disk_ring.cq_head;
+    while (head != __atomic_load_n(disk_ring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &disk_ring.cqes[head & *disk_ring.cq_mask];
+        disk_aio_t *aio = (disk_aio_t *) (uintptr_t) cqe->user_data;
+        long expected = (long) aio->nblocks * BLOCK_SIZE;
+
+        if (cqe->res != expected)
+        {
+            printf("disk i/o error at block %d\n", aio->start_address);
+        }
+        aio->result = cqe->res == expected ? aio->nblocks : -1;
+        if (aio->done != NULL)
+        {
+            aio->done(aio);
+        }
+        aio->complete = 1;
+        disk_ring.inflight--;
+        head++;
+    }
+    __atomic_store_n(disk_ring.cq_head, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&disk_ring_reaped);
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Fills an sqe for the request, vectored over niov buffers   */
+/*when iov is given. Makes room first when the ring is full  */
+/*----------------------------------------------------------*/
+static int ring_push(disk_aio_t *aio, struct iovec *iov, int niov)
+{
+    while (*disk_ring.sq_tail - __atomic_load_n(disk_ring.sq_head, __ATOMIC_ACQUIRE) >= disk_ring.sq_entries
+        || disk_ring.inflight + disk_ring.to_submit >= disk_ring.cq_entries)
+    {
+        if ((disk_ring.to_submit > 0 && ring_enter() < 0) || ring_reap(1) < 0)
+        {
+            return -1;
+        }
+    }
+
+    unsigned tail = *disk_ring.sq_tail;
+    unsigned idx = tail & *disk_ring.sq_mask;
+    struct io_uring_sqe *sqe = &disk_ring.sqes[idx];
+    size_t len = (size_t) aio->nblocks * BLOCK_SIZE;
+    int i;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = disk_ring.fixed_file ? 0 : disk_fd;
+    sqe->flags = disk_ring.fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->off = (unsigned long long) aio->start_address * BLOCK_SIZE;
+    sqe->user_data = (unsigned long long) (uintptr_t) aio;
+    if (iov != NULL && niov > 1)
+    {
+        sqe->opcode = aio->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long long) (uintptr_t) iov;
+        sqe->len = niov;
+    }
+    else
+    {
+        char *buf = iov != NULL ? (char *) iov[0].iov_base : (char *) aio->buffer;
+        sqe->opcode = aio->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->addr = (unsigned long long) (uintptr_t) buf;
+        sqe->len = (unsigned) len;
+        /*Inside a registered buffer, the kernel skips mapping the pages*/
+        for (i = 0; i < disk_ring.nbufs; i++)
+        {
+            char *base = (char *) disk_bufs[i].iov_base;
+            if (buf >= base && buf + len <= base + disk_bufs[i].iov_len)
+            {
+                sqe->opcode = aio->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe->buf_index = i;
+                break;
+            }
+        }
+    }
+    disk_ring.sq_array[idx] = idx;
+    __atomic_store_n(disk_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    disk_ring.to_submit++;
+    aio->complete = 0;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Waits on the ring for a request pushed with ring_push      */
+/*----------------------------------------------------------*/
+static int ring_wait(disk_aio_t *aio)
+{
+    while (!aio->complete)
+    {
+        if (disk_ring.to_submit > 0 && ring_enter() < 0)
+        {
+            return -1;
+        }
+        if (ring_reap(!aio->complete) < 0)
+        {
+            return -1;
+        }
+    }
+    return aio->result;
+}
+
+/*----------------------------------------------------------*/
+/*One request through the ring, submitted and waited for     */
+/*(the lock is let go during the wait, see ring_reap)        */
+/*----------------------------------------------------------*/
+static int ring_transfer(int write, int start_address, int nblocks, char *buffer)
+{
+    disk_aio_t aio;
+
+    memset(&aio, 0, sizeof(aio));
+    aio.write = write;
+    aio.start_address = start_address;
+    aio.nblocks = nblocks;
+    aio.buffer = buffer;
+    pthread_mutex_lock(&disk_ring_lock);
+    int res = ring_push(&aio, NULL, 0) < 0 ? -1 : ring_wait(&aio);
+    pthread_mutex_unlock(&disk_ring_lock);
+    return res;
+}
+
+/*----------------------------------------------------------*/
+/*Sets the buffers registered with the io_uring backend      */
+/*(n = 0 for none), they must stay allocated until replaced  */
+/*----------------------------------------------------------*/
+int register_disk_buffers(void **bufs, size_t *lens, int n)
+{
+    int i;
+
+    if (n < 0 || n > DISK_MAX_BUFFERS)
+    {
+        printf("Number of registered buffers must be between 0 and %d\n", DISK_MAX_BUFFERS);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        disk_bufs[i].iov_base = bufs[i];
+        disk_bufs[i].iov_len = lens[i];
+    }
+    pthread_mutex_lock(&disk_ring_lock);
+    disk_nbufs = n;
+    if (disk_ring.fd >= 0)
+    {
+        /*Nothing in flight may use the old ones*/
+        while (disk_ring.inflight > 0 || disk_ring.to_submit > 0)
+        {
+            if (ring_reap(1) < 0)
+            {
+                pthread_mutex_unlock(&disk_ring_lock);
+                return -1;
+            }
+        }
+        ring_register_buffers();
+    }
+    pthread_mutex_unlock(&disk_ring_lock);
+    return 0;
+}
+
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    run_queue();
+    stop_disk_workers();
+    ring_teardown();
+    free(disk_merge_buf);
+    disk_merge_buf = NULL;
+    if(NULL != disk_map)
+    {
+        munmap(disk_map, disk_map_len);
+        disk_map = NULL;
+    }
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
+    }
+    if(disk_fd >= 0)
+    {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Maps the whole image, growing the file to its size if needed*/
+/*----------------------------------------------------------*/
+static int map_disk(char *filename)
+{
+    struct stat st;
+
+    disk_map_len = (size_t)MAX_BLOCK * BLOCK_SIZE;
+    if (fstat(disk_fd, &st) < 0)
+    {
+        printf("Could not stat %s\n\n", filename);
+        return -1;
+    }
+    if ((size_t)st.st_size < disk_map_len && ftruncate(disk_fd, disk_map_len) < 0)
+    {
+        printf("Could not size disk file %s\n\n", filename);
+        return -1;
+    }
+    disk_map = (char *) mmap(NULL, disk_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (disk_map == MAP_FAILED)
+    {
+        disk_map = NULL;
+        printf("Could not map disk file %s\n\n", filename);
+        return -1;
     }
     return 0;
 }
@@ -28,29 +536,47 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
+    int fd;
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
+    disk_head = 0;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    if (disk_backend == DISK_BACKEND_STDIO)
+    {
+        /*Creates a new file*/
+        fp = fopen (filename, "w+b");
+        fd = (fp == NULL) ? -1 : fileno(fp);
+    }
+    else
+    {
+        disk_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        fd = disk_fd;
+    }
+
+    if (fd < 0)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
     
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Sizes the file in one call, the holes read back as 0's and only written blocks use host space*/
+    if (ftruncate(fd, (off_t)MAX_BLOCK * BLOCK_SIZE) < 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not size disk file %s\n\n", filename);
+        return -1;
+    }
+
+    if (disk_backend == DISK_BACKEND_MMAP)
+    {
+        return map_disk(filename);
+    }
+    if (disk_backend == DISK_BACKEND_URING && ring_setup() < 0)
+    {
+        printf("io_uring not available, using pread/pwrite\n");
     }
     return 0;
 }
@@ -61,7 +587,34 @@ int init_disk(char *filename, int block_size, int num_blocks)
 {
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
+    disk_head = 0;
     
+    if (disk_backend == DISK_BACKEND_MMAP)
+    {
+        disk_fd = open(filename, O_RDWR);
+        if (disk_fd < 0)
+        {
+            printf("Could not open %s\n\n", filename);
+            return -1;
+        }
+        return map_disk(filename);
+    }
+
+    if (disk_backend == DISK_BACKEND_PIO || disk_backend == DISK_BACKEND_URING)
+    {
+        disk_fd = open(filename, O_RDWR);
+        if (disk_fd < 0)
+        {
+            printf("Could not open %s\n\n", filename);
+            return -1;
+        }
+        if (disk_backend == DISK_BACKEND_URING && ring_setup() < 0)
+        {
+            printf("io_uring not available, using pread/pwrite\n");
+        }
+        return 0;
+    }
+
     /*Opens a file*/
     fp = fopen (filename, "r+b");
 
@@ -74,70 +627,762 @@ int init_disk(char *filename, int block_size, int num_blocks)
 }
 
 /*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
+/*pread/pwrite the whole request, retrying on short transfers         */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+static int pio_transfer(int write, int start_address, int nblocks, char *buffer)
 {
-    int i, s;
-    s = 0;
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    off_t pos = (off_t)start_address * BLOCK_SIZE;
+    size_t done = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    while (done < len)
     {
-        printf("out of bound error %d\n", start_address);
-        return -1;
+        ssize_t n;
+        if (write)
+        {
+            n = pwrite(disk_fd, buffer + done, len - done, pos + done);
+        }
+        else
+        {
+            n = pread(disk_fd, buffer + done, len - done, pos + done);
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("disk i/o error at block %d\n", start_address);
+            return -1;
+        }
+        if (n == 0 && write)
+        {
+            /*Nothing written, the disk is full*/
+            printf("disk i/o error at block %d\n", start_address);
+            return -1;
+        }
+        if (n == 0)
+        {
+            /*Past the end of the image, reads back as 0's*/
+            memset(buffer + done, 0, len - done);
+            break;
+        }
+        done += n;
     }
+    return nblocks;
+}
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+/*-------------------------------------------------------------------*/
+/*Returns the simulated time                                          */
+/*-------------------------------------------------------------------*/
+static double disk_now()
+{
+    pthread_mutex_lock(&disk_model_lock);
+    double now = disk_clock;
+    pthread_mutex_unlock(&disk_model_lock);
+    return now;
+}
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+/*-------------------------------------------------------------------*/
+/*Charges the modelled service time of a request issued at simulated */
+/*time issued and moves the head, returns the time it completes at   */
+/*and its service time in service_us.                                */
+/*The latency of requests in flight together overlaps, their seeks   */
+/*and transfers do not. Nothing sleeps, see disk_model               */
+/*-------------------------------------------------------------------*/
+static double disk_charge(int write, int start_address, int nblocks, double issued, double *service_us)
+{
+    pthread_mutex_lock(&disk_model_lock);
+    int distance = start_address > disk_head ? start_address - disk_head : disk_head - start_address;
+    double service = r * distance + disk_xfer * nblocks;
+    double t = L + service;
+    double begin = issued + L > disk_busy_until ? issued + L : disk_busy_until;
+
+    disk_busy_until = begin + service;
+    disk_stats.requests++;
+    if (write)
     {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        disk_stats.blocks_written += nblocks;
+    }
+    else
+    {
+        disk_stats.blocks_read += nblocks;
+    }
+    disk_stats.seek_blocks += distance;
+    disk_stats.busy_us += t;
+    if (disk_busy_until > disk_clock)
+    {
+        disk_clock = disk_busy_until;
+    }
+    disk_head = start_address + nblocks;
+    double completed = disk_busy_until;
+    pthread_mutex_unlock(&disk_model_lock);
+    if (service_us != NULL)
+    {
+        *service_us = t;
     }
+    return completed;
+}
+
+/*-------------------------------------------------------------------*/
+/*Charges a request with disk_charge and, when asked to, pauses for  */
+/*its modelled service time                                          */
+/*-------------------------------------------------------------------*/
+static double disk_model(int write, int start_address, int nblocks, double issued)
+{
+    double t;
+    double completed = disk_charge(write, start_address, nblocks, issued, &t);
+
+    /*Pause until the latency duration is elapsed*/
+    if (disk_sleep && t >= 1)
+    {
+        usleep((useconds_t)t);
+    }
+    return completed;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads blocks from the disk file with the selected backend          */
+/*-------------------------------------------------------------------*/
+static int do_read(int start_address, int nblocks, void *buffer)
+{
+    int i, s;
+    s = 0;
+
+    if (disk_backend == DISK_BACKEND_MMAP)
+    {
+        memcpy(buffer, disk_map + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    if (disk_ring.fd >= 0)
+    {
+        return ring_transfer(0, start_address, nblocks, (char *)buffer);
+    }
+
+    if (disk_backend == DISK_BACKEND_PIO || disk_backend == DISK_BACKEND_URING)
+    {
+        /*One pread straight into the caller's buffer*/
+        return pio_transfer(0, start_address, nblocks, (char *)buffer);
+    }
+
+    /*Sets up a temporary buffer*/
+    void* blockRead = (void*) malloc(BLOCK_SIZE);
+
+    /*Goto the data requested from the disk*/
+    pthread_mutex_lock(&disk_stdio_lock);
+    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+
+    /*For every block requested*/
+    for (i = 0; i < nblocks; ++i)
+    {
+        s++;
+        fread(blockRead, BLOCK_SIZE, 1, fp);
+        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+    }
+    pthread_mutex_unlock(&disk_stdio_lock);
 
     free(blockRead);
     return s;
 }
 
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+/*-------------------------------------------------------------------*/
+/*Writes blocks to the disk file with the selected backend           */
+/*-------------------------------------------------------------------*/
+static int do_write(int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    if (disk_backend == DISK_BACKEND_MMAP)
+    {
+        /*Reaches the file on msync in sync_disk() or when the kernel writes the page back*/
+        memcpy(disk_map + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (disk_ring.fd >= 0)
     {
-        printf("out of bound error\n");
-        return -1;
+        return ring_transfer(1, start_address, nblocks, (char *)buffer);
     }
 
+    if (disk_backend == DISK_BACKEND_PIO || disk_backend == DISK_BACKEND_URING)
+    {
+        /*One pwrite straight from the caller's buffer, no stdio buffering to flush*/
+        return pio_transfer(1, start_address, nblocks, (char *)buffer);
+    }
+
+    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+
     /*Goto where the data is to be written on the disk*/        
+    pthread_mutex_lock(&disk_stdio_lock);
     fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
         memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
 
+        /*Stays in the stdio buffer until the next fseek, flush_disk() or sync_disk()*/
         fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
         s++;
     }
+    pthread_mutex_unlock(&disk_stdio_lock);
     free(blockWrite);
     return s;
 }
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Queued writes may cover these blocks*/
+    run_queue();
+    disk_model(0, start_address, nblocks, disk_now());
+    return do_read(start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    run_queue();
+    disk_model(1, start_address, nblocks, disk_now());
+    return do_write(start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Adds a request to the queue, the buffer must stay untouched until  */
+/*run_queue() returns. The queue is run first when it is full or     */
+/*when the request overlaps one already queued                       */
+/*------------------------------------------------------------------*/
+int queue_blocks(int write, int start_address, int nblocks, void *buffer)
+{
+    int i;
+
+    if (start_address < 0 || nblocks <= 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    pthread_mutex_lock(&disk_queue_lock);
+    for (i = 0; i < disk_queue_len; i++)
+    {
+        disk_req_t *q = &disk_queue[i];
+        if (start_address < q->start_address + q->nblocks && q->start_address < start_address + nblocks)
+        {
+            break;
+        }
+    }
+    if (i < disk_queue_len || disk_queue_len == DISK_QUEUE_DEPTH)
+    {
+        if (serve_queue() < 0)
+        {
+            pthread_mutex_unlock(&disk_queue_lock);
+            return -1;
+        }
+    }
+    disk_queue[disk_queue_len].write = write;
+    disk_queue[disk_queue_len].start_address = start_address;
+    disk_queue[disk_queue_len].nblocks = nblocks;
+    disk_queue[disk_queue_len].buffer = (char *)buffer;
+    disk_queue[disk_queue_len].queued = disk_now();
+    disk_queue_len++;
+    pthread_mutex_unlock(&disk_queue_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the queued request to serve next                           */
+/*------------------------------------------------------------------*/
+static int pick_request()
+{
+    int i;
+    int next = -1;
+    int lowest = 0;
+
+    /*Arrival order, or the oldest one once it has waited too long*/
+    if (disk_sched == DISK_SCHED_FIFO || disk_now() - disk_queue[0].queued > disk_deadline)
+    {
+        return 0;
+    }
+    /*C-SCAN : the closest request ahead of the head, else the lowest one*/
+    pthread_mutex_lock(&disk_model_lock);
+    int head = disk_head;
+    pthread_mutex_unlock(&disk_model_lock);
+    for (i = 0; i < disk_queue_len; i++)
+    {
+        int start = disk_queue[i].start_address;
+        if (start >= head && (next < 0 || start < disk_queue[next].start_address))
+        {
+            next = i;
+        }
+        if (start < disk_queue[lowest].start_address)
+        {
+            lowest = i;
+        }
+    }
+    return next >= 0 ? next : lowest;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the queued request of the same direction starting right    */
+/*after block end, -1 if there is none                               */
+/*------------------------------------------------------------------*/
+static int find_adjacent(int write, int end)
+{
+    int i;
+    for (i = 0; i < disk_queue_len; i++)
+    {
+        if (disk_queue[i].write == write && disk_queue[i].start_address == end)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Removes request i from the queue, keeping the arrival order        */
+/*------------------------------------------------------------------*/
+static void dequeue(int i)
+{
+    memmove(&disk_queue[i], &disk_queue[i + 1], sizeof(disk_req_t) * (disk_queue_len - i - 1));
+    disk_queue_len--;
+}
+
+/*------------------------------------------------------------------*/
+/*Serves every queued request in scheduler order, requests adjacent  */
+/*on disk being merged into one transfer with the elevator. Called   */
+/*with disk_queue_lock held                                          */
+/*------------------------------------------------------------------*/
+static int serve_queue()
+{
+    int res = 0;
+    disk_aio_t *ops = NULL;         /*with the ring, one request per merged group, all submitted together*/
+    struct iovec *iov = NULL;
+    int nops = 0;
+    int niov = 0;
+
+    if (disk_queue_len > 0 && disk_ring.fd >= 0)
+    {
+        ops = (disk_aio_t *) malloc(sizeof(disk_aio_t) * disk_queue_len);
+        iov = (struct iovec *) malloc(sizeof(struct iovec) * disk_queue_len);
+        if (ops == NULL || iov == NULL)
+        {
+            free(ops);
+            free(iov);
+            ops = NULL;
+            iov = NULL;
+        }
+    }
+    if (ops != NULL)
+    {
+        pthread_mutex_lock(&disk_ring_lock);
+    }
+    if (disk_queue_len > 0 && disk_sched == DISK_SCHED_ELEVATOR && disk_merge_buf == NULL)
+    {
+        disk_merge_buf = (char *) malloc((size_t)DISK_MAX_MERGE * BLOCK_SIZE);
+    }
+    while (disk_queue_len > 0)
+    {
+        int i = pick_request();
+        disk_req_t first = disk_queue[i];
+        disk_req_t merged[DISK_MAX_MERGE];
+        int nmerged = 0;
+        int nblocks = first.nblocks;
+        int j;
+
+        dequeue(i);
+        merged[nmerged++] = first;
+        if (disk_sched == DISK_SCHED_ELEVATOR && (disk_merge_buf != NULL || ops != NULL))
+        {
+            while (nmerged < DISK_MAX_MERGE && (j = find_adjacent(first.write, first.start_address + nblocks)) >= 0
+                && nblocks + disk_queue[j].nblocks <= DISK_MAX_MERGE)
+            {
+                merged[nmerged++] = disk_queue[j];
+                nblocks += disk_queue[j].nblocks;
+                dequeue(j);
+            }
+        }
+
+        disk_model(first.write, first.start_address, nblocks, disk_now());
+        if (ops != NULL)
+        {
+            /*Merged requests become one vectored transfer, no staging copy*/
+            disk_aio_t *op = &ops[nops++];
+            memset(op, 0, sizeof(disk_aio_t));
+            op->write = first.write;
+            op->start_address = first.start_address;
+            op->nblocks = nblocks;
+            op->buffer = first.buffer;
+            for (j = 0; j < nmerged; j++)
+            {
+                iov[niov + j].iov_base = merged[j].buffer;
+                iov[niov + j].iov_len = (size_t)merged[j].nblocks * BLOCK_SIZE;
+            }
+            if (ring_push(op, &iov[niov], nmerged) < 0)
+            {
+                res = -1;
+                nops--;
+            }
+            niov += nmerged;
+            disk_stats.merged += nmerged - 1;
+            continue;
+        }
+        if (nmerged == 1)
+        {
+            if ((first.write ? do_write(first.start_address, nblocks, first.buffer)
+                : do_read(first.start_address, nblocks, first.buffer)) < 0)
+            {
+                res = -1;
+            }
+            continue;
+        }
+
+        /*Merged requests go through the staging buffer in one transfer*/
+        disk_stats.merged += nmerged - 1;
+        size_t off = 0;
+        if (first.write)
+        {
+            for (j = 0; j < nmerged; j++)
+            {
+                memcpy(disk_merge_buf + off, merged[j].buffer, (size_t)merged[j].nblocks * BLOCK_SIZE);
+                off += (size_t)merged[j].nblocks * BLOCK_SIZE;
+            }
+            if (do_write(first.start_address, nblocks, disk_merge_buf) < 0)
+            {
+                res = -1;
+            }
+        }
+        else
+        {
+            if (do_read(first.start_address, nblocks, disk_merge_buf) < 0)
+            {
+                res = -1;
+            }
+            for (j = 0; j < nmerged; j++)
+            {
+                memcpy(merged[j].buffer, disk_merge_buf + off, (size_t)merged[j].nblocks * BLOCK_SIZE);
+                off += (size_t)merged[j].nblocks * BLOCK_SIZE;
+            }
+        }
+    }
+    if (ops != NULL)
+    {
+        /*The whole queue goes to the kernel in one io_uring_enter*/
+        int k;
+        for (k = 0; k < nops; k++)
+        {
+            if (ring_wait(&ops[k]) < 0)
+            {
+                res = -1;
+            }
+        }
+        pthread_mutex_unlock(&disk_ring_lock);
+        free(ops);
+        free(iov);
+    }
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Serves every queued request, see serve_queue                       */
+/*------------------------------------------------------------------*/
+int run_queue()
+{
+    pthread_mutex_lock(&disk_queue_lock);
+    int res = serve_queue();
+    pthread_mutex_unlock(&disk_queue_lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Serves submitted requests until stop_disk_workers()                */
+/*------------------------------------------------------------------*/
+static void *disk_worker(void *arg)
+{
+    double chan = 0;    /*simulated time this thread is done with its last request, 1 request in flight per thread*/
+
+    pthread_mutex_lock(&disk_aio_lock);
+    for (;;)
+    {
+        while (disk_aio_head == NULL && !disk_stop)
+        {
+            pthread_cond_wait(&disk_aio_ready, &disk_aio_lock);
+        }
+        disk_aio_t *aio = disk_aio_head;
+        if (aio == NULL)
+        {
+            break;
+        }
+        disk_aio_head = aio->next;
+        if (disk_aio_head == NULL)
+        {
+            disk_aio_tail = NULL;
+        }
+        pthread_mutex_unlock(&disk_aio_lock);
+
+        /*Transfers outside the lock, the threads overlap their latencies*/
+        chan = disk_model(aio->write, aio->start_address, aio->nblocks, aio->issued > chan ? aio->issued : chan);
+        aio->result = aio->write ? do_write(aio->start_address, aio->nblocks, aio->buffer)
+            : do_read(aio->start_address, aio->nblocks, aio->buffer);
+        if (aio->done != NULL)
+        {
+            aio->done(aio);
+        }
+
+        pthread_mutex_lock(&disk_aio_lock);
+        aio->complete = 1;
+        pthread_cond_broadcast(&disk_aio_done);
+    }
+    pthread_mutex_unlock(&disk_aio_lock);
+    return arg;
+}
+
+/*------------------------------------------------------------------*/
+/*Sets the number of threads serving submitted requests, 0 to serve  */
+/*them in submit_blocks()                                            */
+/*------------------------------------------------------------------*/
+int set_disk_workers(int nworkers)
+{
+    if (nworkers < 0 || nworkers > DISK_MAX_WORKERS)
+    {
+        printf("Number of disk workers must be between 0 and %d\n", DISK_MAX_WORKERS);
+        return -1;
+    }
+    stop_disk_workers();
+    disk_want_workers = nworkers;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Waits for the submitted requests and stops the threads             */
+/*------------------------------------------------------------------*/
+void stop_disk_workers()
+{
+    int i;
+
+    pthread_mutex_lock(&disk_aio_lock);
+    disk_stop = 1;
+    pthread_cond_broadcast(&disk_aio_ready);
+    pthread_mutex_unlock(&disk_aio_lock);
+    for (i = 0; i < disk_nworkers; i++)
+    {
+        pthread_join(disk_workers[i], NULL);
+    }
+    disk_nworkers = 0;
+    disk_stop = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Hands a batch of requests to the threads and returns without       */
+/*waiting. Each one completes with its done callback (called from a  */
+/*thread) and wait_blocks(), the buffers must stay untouched until   */
+/*then                                                               */
+/*------------------------------------------------------------------*/
+int submit_blocks(disk_aio_t **aio, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (aio[i]->start_address < 0 || aio[i]->nblocks <= 0 || aio[i]->start_address + aio[i]->nblocks > MAX_BLOCK)
+        {
+            printf("out of bound error %d\n", aio[i]->start_address);
+            return -1;
+        }
+    }
+    /*Queued requests may cover the same blocks*/
+    run_queue();
+
+    if (disk_ring.fd >= 0)
+    {
+        /*The ring is the queue, no thread needed: one io_uring_enter for the batch*/
+        double issued = disk_now();
+        double completed = issued;
+        int res = 0;
+        pthread_mutex_lock(&disk_ring_lock);
+        for (i = 0; i < n && res == 0; i++)
+        {
+            aio[i]->result = 0;
+            aio[i]->issued = issued;
+            aio[i]->next = NULL;
+            completed = disk_charge(aio[i]->write, aio[i]->start_address, aio[i]->nblocks, issued, NULL);
+            res = ring_push(aio[i], NULL, 0);
+        }
+        if (res == 0)
+        {
+            res = ring_enter();
+        }
+        pthread_mutex_unlock(&disk_ring_lock);
+        /*All in flight at once, a single pause for the whole batch*/
+        if (disk_sleep && completed - issued >= 1)
+        {
+            usleep((useconds_t)(completed - issued));
+        }
+        return res;
+    }
+
+    double now = disk_now();
+    pthread_mutex_lock(&disk_aio_lock);
+    while (disk_nworkers < disk_want_workers)
+    {
+        if (pthread_create(&disk_workers[disk_nworkers], NULL, disk_worker, NULL) != 0)
+        {
+            break;
+        }
+        disk_nworkers++;
+    }
+    int threads = disk_nworkers;
+    for (i = 0; i < n; i++)
+    {
+        aio[i]->complete = 0;
+        aio[i]->result = 0;
+        aio[i]->issued = now;
+        aio[i]->next = NULL;
+        if (threads == 0)
+        {
+            continue;
+        }
+        if (disk_aio_tail != NULL)
+        {
+            disk_aio_tail->next = aio[i];
+        }
+        else
+        {
+            disk_aio_head = aio[i];
+        }
+        disk_aio_tail = aio[i];
+    }
+    pthread_cond_broadcast(&disk_aio_ready);
+    pthread_mutex_unlock(&disk_aio_lock);
+
+    if (threads == 0)
+    {
+        /*No thread, served right away one after the other*/
+        for (i = 0; i < n; i++)
+        {
+            now = disk_model(aio[i]->write, aio[i]->start_address, aio[i]->nblocks, now);
+            aio[i]->result = aio[i]->write ? do_write(aio[i]->start_address, aio[i]->nblocks, aio[i]->buffer)
+                : do_read(aio[i]->start_address, aio[i]->nblocks, aio[i]->buffer);
+            if (aio[i]->done != NULL)
+            {
+                aio[i]->done(aio[i]);
+            }
+            aio[i]->complete = 1;
+        }
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Waits for a submitted request, returns its number of blocks or -1  */
+/*------------------------------------------------------------------*/
+int wait_blocks(disk_aio_t *aio)
+{
+    if (disk_ring.fd >= 0)
+    {
+        pthread_mutex_lock(&disk_ring_lock);
+        int res = ring_wait(aio);
+        pthread_mutex_unlock(&disk_ring_lock);
+        return res;
+    }
+    pthread_mutex_lock(&disk_aio_lock);
+    while (!aio->complete)
+    {
+        pthread_cond_wait(&disk_aio_done, &disk_aio_lock);
+    }
+    pthread_mutex_unlock(&disk_aio_lock);
+    return aio->result;
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the device counters and the simulated time                  */
+/*------------------------------------------------------------------*/
+void get_disk_stats(disk_stats_t *stats)
+{
+    *stats = disk_stats;
+    stats->clock_us = disk_clock;
+}
+
+/*------------------------------------------------------------------*/
+/*Hands everything written so far to the disk file (queued requests, */
+/*the stdio buffer) without waiting for the device : a process that  */
+/*dies afterwards cannot lose it, a power loss still can            */
+/*------------------------------------------------------------------*/
+int flush_disk()
+{
+    run_queue();
+    if (fp != NULL)
+    {
+        pthread_mutex_lock(&disk_stdio_lock);
+        int res = fflush(fp);
+        pthread_mutex_unlock(&disk_stdio_lock);
+        if (res != 0)
+        {
+            return -1;
+        }
+    }
+    /*pwrite, io_uring and the shared mapping already left it in the page cache*/
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Makes everything written so far durable in the disk file          */
+/*------------------------------------------------------------------*/
+int sync_disk()
+{
+    if (flush_disk() < 0)
+    {
+        return -1;
+    }
+    if (disk_map != NULL)
+    {
+        return msync(disk_map, disk_map_len, MS_SYNC);
+    }
+    if (fp != NULL)
+    {
+        /*The image is sized when created, only the data needs to reach the device*/
+        return fdatasync(fileno(fp));
+    }
+    if (disk_fd >= 0)
+    {
+        return fdatasync(disk_fd);
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the start of the mapped image, NULL unless using mmap      */
+/*------------------------------------------------------------------*/
+void *get_disk_map()
+{
+    return disk_map;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the descriptor of the image file for transfers done by the */
+/*caller (splice), -1 with the stdio backend whose FILE buffers would */
+/*be bypassed                                                        */
+/*------------------------------------------------------------------*/
+int get_disk_fd()
+{
+    return disk_backend == DISK_BACKEND_STDIO ? -1 : disk_fd;
+}
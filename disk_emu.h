@@ -1,5 +1,60 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#include <stddef.h>
+
+#define DISK_BACKEND_STDIO      0       //FILE* with fseek and fread/fwrite through a bounce buffer
+#define DISK_BACKEND_PIO        1       //file descriptor with one pread/pwrite per request (default)
+#define DISK_BACKEND_MMAP       2       //whole image mapped in memory, blocks copied with memcpy
+#define DISK_BACKEND_URING      3       //io_uring with the image and buffers registered, pread/pwrite if unavailable
+
+#define DISK_SCHED_FIFO         0       //queued requests served in arrival order
+#define DISK_SCHED_ELEVATOR     1       //C-SCAN from the head, adjacent requests merged, oldest first past its deadline (default)
+
+//device counters, times in simulated microseconds
+typedef struct _disk_stats_t{
+    long requests;          //transfers issued to the disk file
+    long blocks_read;
+    long blocks_written;
+    long seek_blocks;       //blocks the head travelled
+    long merged;            //queued requests merged into another one
+    double busy_us;         //modelled service time
+    double clock_us;        //simulated time
+}disk_stats_t;
+
+//asynchronous request, owned by the caller until it completes
+typedef struct _disk_aio_t{
+    int write;              //1 to write the buffer, 0 to read into it
+    int start_address;
+    int nblocks;
+    void *buffer;
+    void (*done)(struct _disk_aio_t *aio);  //called by the thread that served or reaped it, may be NULL
+    void *arg;              //for the caller
+    int result;             //number of blocks or -1, once complete
+    int complete;           //1 once served
+    double issued;          //simulated time it was submitted at
+    struct _disk_aio_t *next;
+}disk_aio_t;
+
+int set_disk_backend(int backend);
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int queue_blocks(int write, int start_address, int nblocks, void *buffer);
+int run_queue();
+int flush_disk();
+int sync_disk();
 int close_disk();
+void *get_disk_map();
+int get_disk_fd();
+int set_disk_latency(double request_us, double seek_us, double xfer_us, int sleep);
+int set_disk_scheduler(int sched, double deadline_us);
+int set_disk_workers(int nworkers);
+void stop_disk_workers();
+int submit_blocks(disk_aio_t **aio, int n);
+int wait_blocks(disk_aio_t *aio);
+void get_disk_stats(disk_stats_t *stats);
+int register_disk_buffers(void **bufs, size_t *lens, int n);
+
+#endif
@@ -1,4 +1,5 @@
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE     /* splice, F_SETPIPE_SZ */
 
 #include <fuse.h>
 #include <stdio.h>
@@ -10,9 +11,81 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* 1 formats a new disk at every mount, fuse_wrap_old.c sets 0 to mount the
+ * disk left by the last run */
+#ifndef SFS_FUSE_FRESH
+#define SFS_FUSE_FRESH 1
+#endif
+
+/* largest read and write request asked from the kernel, it caps them at 128 KB */
+#define SFS_FUSE_MAX_IO     (128 * 1024)
+
+/* sfs_fopen hands out the same descriptor to every open of a file, so it is
+ * only closed once the last kernel handle on it is released */
+static int *fd_opens = NULL;
+static int fd_opens_len = 0;
+static pthread_mutex_t fd_opens_lock = PTHREAD_MUTEX_INITIALIZER;
+/* sfs_getnextfilename walks the directory with a single cursor */
+static pthread_mutex_t readdir_lock = PTHREAD_MUTEX_INITIALIZER;
+/* pipe of each serving thread that reads are spliced into, see fuse_read_buf */
+static __thread int read_pipe[2] = {-1, -1};
+
+/* called with fd_opens_lock held */
+static int fd_hold(int fd)
+{
+    if (fd >= fd_opens_len) {
+        int len = fd + 64;
+        int *opens = realloc(fd_opens, sizeof(int) * len);
+        if (opens == NULL)
+            return -ENOMEM;
+        memset(opens + fd_opens_len, 0, sizeof(int) * (len - fd_opens_len));
+        fd_opens = opens;
+        fd_opens_len = len;
+    }
+    fd_opens[fd]++;
+    return 0;
+}
+
+static void fd_drop(int fd)
+{
+    pthread_mutex_lock(&fd_opens_lock);
+    if (fd < fd_opens_len && fd_opens[fd] > 0 && --fd_opens[fd] == 0)
+        sfs_fclose(fd);
+    pthread_mutex_unlock(&fd_opens_lock);
+}
+
+static int fuse_hold_open(const char *path, struct fuse_file_info *fi)
+{
+    char filename[MAXFILENAME + 1];
+    int fd;
+    int res;
+    
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
+    strcpy(filename, path);
+    
+    pthread_mutex_lock(&fd_opens_lock);
+    fd = sfs_fopen(filename);
+    if (fd == -1) {
+        pthread_mutex_unlock(&fd_opens_lock);
+        return -ENOSPC;     /* no free inode, directory entry or descriptor */
+    }
+    res = fd_hold(fd);
+    if (res < 0)
+        sfs_fclose(fd);     /* past the table, no other handle has it */
+    pthread_mutex_unlock(&fd_opens_lock);
+    if (res < 0)
+        return res;
+    
+    fi->fh = fd;
+    return 0;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -36,7 +109,7 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    char file_name[MAXFILENAME + 1];
     
     if (strcmp(path, "/") != 0)
         return -ENOENT;
@@ -44,9 +117,11 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     
+    pthread_mutex_lock(&readdir_lock);
     while(sfs_getnextfilename(file_name)) {
         filler(buf, &file_name[1], NULL, 0);
     }
+    pthread_mutex_unlock(&readdir_lock);
     
     return 0;
 }
@@ -54,8 +129,10 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[MAXFILENAME];
+    char filename[MAXFILENAME + 1];
     
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     res = sfs_remove(filename);
     if (res == -1)
@@ -65,75 +142,254 @@ static int fuse_unlink(const char *path)
 }
 
 static int fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    return fuse_hold_open(path, fi);
+}
+
+static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
+        struct fuse_file_info *fi)
 {
     int res;
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
     
-    res = sfs_fopen(filename);
+    res = sfs_pread(fi->fh, buf, size, offset);
     if (res == -1)
-        return -errno;
+        return -EIO;
     
-    sfs_fclose(res);
-    return 0;
+    return res;
 }
 
-static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
-        struct fuse_file_info *fi)
+static int fuse_write(const char *path, const char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
+    res = sfs_pwrite(fi->fh, buf, size, offset);
+    if (res == -1)
+        return -EIO;
+    if (res == 0 && size > 0)
+        return -ENOSPC;
     
-    strcpy(filename, path);
+    return res;
+}
+
+/* maps size bytes of the file from offset to runs of the disk file in one sfs_map call, assigning
+ * the blocks when writing; the file stays locked until sfs_unmap. Returns a malloc'd array (NULL on
+ * error, nothing is mapped then) and the number of runs in count */
+static sfs_extent_t *fuse_map(int fd, off_t offset, size_t size, int write, int *count)
+{
+    int cap = size / 512 + 2;   /* a run per block at worst, blocks are at least 512 bytes */
+    sfs_extent_t *ext = malloc(sizeof(sfs_extent_t) * cap);
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
+    if (ext == NULL)
+        return NULL;
+    *count = sfs_map(fd, offset, size, write, ext, cap);
+    if (*count < 0) {
+        free(ext);
+        return NULL;
+    }
+    return ext;
+}
+
+/* returns the read end of the pipe of this thread, empty and big enough for size bytes,
+ * or -1 if there is none (reads are then copied through memory) */
+static int fuse_read_pipe(size_t size)
+{
+    int left = 0;
+    char drain[4096];
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (read_pipe[0] < 0) {
+        if (pipe2(read_pipe, O_CLOEXEC) < 0)
+            return -1;
+        /* runs that do not start on a page take a pipe slot per page piece, so more room is asked first */
+        if (fcntl(read_pipe[1], F_SETPIPE_SZ, 4 * SFS_FUSE_MAX_IO) < 0
+                && fcntl(read_pipe[1], F_SETPIPE_SZ, SFS_FUSE_MAX_IO) < SFS_FUSE_MAX_IO) {
+            close(read_pipe[0]);
+            close(read_pipe[1]);
+            read_pipe[0] = read_pipe[1] = -1;
+            return -1;
+        }
+    }
+    if (size > SFS_FUSE_MAX_IO)
+        return -1;
+    /* what a failed reply left behind */
+    while (ioctl(read_pipe[0], FIONREAD, &left) == 0 && left > 0)
+        if (read(read_pipe[0], drain, left < (int)sizeof(drain) ? left : (int)sizeof(drain)) <= 0)
+            return -1;
+    return read_pipe[0];
+}
+
+/* buffer vector with one fd buffer per run, the data is spliced from or to the disk file */
+static struct fuse_bufvec *fuse_extents_bufvec(sfs_extent_t *ext, int n, int disk_fd)
+{
+    struct fuse_bufvec *bv = calloc(1, sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf) * (n > 0 ? n - 1 : 0));
+    if (bv == NULL)
+        return NULL;
+    bv->count = n > 0 ? n : 1;    /* a single empty buffer at the end of the file */
+    for (int i = 0; i < n; i++) {
+        bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[i].fd = disk_fd;
+        bv->buf[i].pos = ext[i].disk_off;
+        bv->buf[i].size = ext[i].len;
+    }
+    return bv;
+}
+
+/* splices the runs into the pipe of this thread, returns the number of bytes or -1 if it
+ * could not take them all */
+static ssize_t fuse_splice_extents(int disk_fd, sfs_extent_t *ext, int n)
+{
+    ssize_t len = 0;
     
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    for (int i = 0; i < n; i++) {
+        loff_t pos = ext[i].disk_off;
+        size_t left = ext[i].len;
+        while (left > 0) {
+            ssize_t k = splice(disk_fd, &pos, read_pipe[1], NULL, left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (k <= 0)
+                return -1;
+            left -= k;
+            len += k;
+        }
+    }
+    return len;
+}
+
+/* reads the runs into mem, returns the number of bytes or -1 */
+static ssize_t fuse_copy_extents(int disk_fd, sfs_extent_t *ext, int n, char *mem)
+{
+    ssize_t len = 0;
     
-    sfs_fclose(fd);
-    return res;
+    for (int i = 0; i < n; i++) {
+        if (pread(disk_fd, mem + len, ext[i].len, ext[i].disk_off) != ext[i].len)
+            return -1;
+        len += ext[i].len;
+    }
+    return len;
 }
 
-static int fuse_write(const char *path, const char *buf, size_t size,
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
-    
-    char filename[MAXFILENAME];
+    int disk_fd = get_disk_fd();
+    int pipe_fd = disk_fd >= 0 ? fuse_read_pipe(size) : -1;
+    struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+    char *mem = NULL;
+    ssize_t len = -1;
+    int n;
     
-    strcpy(filename, path);
+    if (bv == NULL)
+        return -ENOMEM;
+    if (pipe_fd < 0) {  /* no descriptor to splice from, copy through memory */
+        mem = malloc(size);
+        if (mem == NULL) {
+            free(bv);
+            return -ENOMEM;
+        }
+        len = sfs_pread(fi->fh, mem, size, offset);
+        if (len == -1) {
+            free(bv);
+            free(mem);
+            return -EIO;
+        }
+        *bv = FUSE_BUFVEC_INIT(len);
+        bv->buf[0].mem = mem;
+        *bufp = bv;
+        return 0;
+    }
     
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
+    sfs_extent_t *ext = fuse_map(fi->fh, offset, size, 0, &n);
+    if (ext == NULL) {
+        free(bv);
+        return -EIO;
+    }
+    /* the runs only hold the file while it is mapped, so they are spliced into the pipe now
+     * and libfuse splices them on from there once the file is unlocked; runs the pipe has
+     * no room for are copied through memory instead, still mapped */
+    len = fuse_splice_extents(disk_fd, ext, n);
+    if (len < 0 && fuse_read_pipe(0) >= 0 && (mem = malloc(size)) != NULL)
+        len = fuse_copy_extents(disk_fd, ext, n, mem);
+    sfs_unmap(fi->fh, ext, n, 0);
+    free(ext);
+    if (len < 0) {
+        free(bv);
+        free(mem);
+        return -EIO;
+    }
+    *bv = FUSE_BUFVEC_INIT(len);
+    if (mem != NULL) {
+        bv->buf[0].mem = mem;
+    } else {
+        bv->buf[0].flags = FUSE_BUF_IS_FD;
+        bv->buf[0].fd = pipe_fd;
+    }
+    *bufp = bv;
+    return 0;
+}
+
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+        struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    int disk_fd = get_disk_fd();
+    int n;
+    ssize_t res;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (disk_fd < 0) {  /* no descriptor to splice to, copy through memory */
+        struct fuse_bufvec mem_bv = FUSE_BUFVEC_INIT(size);
+        mem_bv.buf[0].mem = malloc(size);
+        if (mem_bv.buf[0].mem == NULL)
+            return -ENOMEM;
+        res = fuse_buf_copy(&mem_bv, buf, 0);
+        if (res >= 0)
+            res = sfs_pwrite(fi->fh, mem_bv.buf[0].mem, res, offset);
+        free(mem_bv.buf[0].mem);
+        return res < 0 ? -EIO : res;
+    }
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    sfs_extent_t *ext = fuse_map(fi->fh, offset, size, 1, &n);
+    if (ext == NULL)
+        return -EIO;
+    struct fuse_bufvec *dst = n > 0 ? fuse_extents_bufvec(ext, n, disk_fd) : NULL;
+    if (n == 0)
+        res = size > 0 ? -ENOSPC : 0;
+    else if (dst == NULL)
+        res = -ENOMEM;
+    else    /* the data lands in the blocks before the size covers them */
+        res = fuse_buf_copy(dst, buf, 0);
+    sfs_unmap(fi->fh, ext, n, res > 0 ? res : 0);
+    free(dst);
+    free(ext);
     
-    sfs_fclose(fd);
     return res;
 }
 
+static int fuse_flush(const char *path, struct fuse_file_info *fi)
+{
+    /* close(2) of one of the handles, data reaches the disk on fsync or when the file system exits */
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    fd_drop(fi->fh);
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    if (sfs_fsync(fi->fh) == -1)
+        return -EIO;
+    
+    return 0;
+}
+
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
+    char filename[MAXFILENAME + 1];
     int fd;
     
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
     fd = sfs_remove(filename);
@@ -157,17 +413,23 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
-    int fd;
-    
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
-    
-    sfs_fclose(fd);
-    return 0;
+    return fuse_hold_open(path, fp);
+}
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    /* big requests, and read ahead sent without waiting for the previous read */
+    conn->async_read = 1;
+    conn->max_write = SFS_FUSE_MAX_IO;
+    conn->max_readahead = SFS_FUSE_MAX_IO;
+    conn->want |= (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES) & conn->capable;
+    /* read_buf/write_buf data moved between /dev/fuse and the disk file with splice */
+    conn->want |= (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE) & conn->capable;
+    return NULL;
 }
 
 static struct fuse_operations xmp_oper = {
+    .init = fuse_init,
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
@@ -176,12 +438,29 @@ static struct fuse_operations xmp_oper = {
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .read_buf = fuse_read_buf,
+    .write_buf = fuse_write_buf,
+    .flush = fuse_flush,
+    .release = fuse_release,
+    .fsync = fuse_fsync,
     .access = fuse_access,
     .create = fuse_create,
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char mount_opts[128];
+    int res;
+    
+    mksfs(SFS_FUSE_FRESH);
+    /* fuse_main serves requests from several threads unless -s is given, the sfs
+     * core locks per file */
+    snprintf(mount_opts, sizeof(mount_opts), "-obig_writes,async_read,max_read=%d,max_write=%d",
+            SFS_FUSE_MAX_IO, SFS_FUSE_MAX_IO);
+    if (fuse_opt_add_arg(&args, mount_opts) == -1)
+        return 1;
+    res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
@@ -0,0 +1,608 @@
+/* journal.c
+ *
+ * Write-ahead log for the file system metadata, kept in its own region of the disk.
+ * A metadata change is logged as a compact record (disk block, byte range, new bytes) and the block
+ * itself goes into the cache held, so it cannot reach its home location before the log does.
+ * The records of several sfs_* calls are committed together as one transaction, written to the log
+ * with a single sequential write_blocks, after which the held blocks are released and get checkpointed
+ * to their home location by the normal cache write back. Once the log is half full, a checkpoint writes
+ * the cache back and the log starts over. It only runs right after a commit, when no block is held,
+ * so every block with committed changes can be written home.
+ * At mount, the committed transactions are replayed onto the home blocks.
+ * sfs_* calls run concurrently between journal_begin_op() and journal_end_op(). A commit waits until
+ * none is in progress, so a transaction only ever holds whole calls, and new calls wait for it.
+ * A call only begins once the transaction has room left for its share (JOURNAL_OP_HOLD held blocks and
+ * JOURNAL_OP_LOG log blocks) on top of the shares of the calls in progress. A call that can change more
+ * (a long write, removing a large file) checks journal_op_full() as it goes and ends early, going on in
+ * a new call. If a transaction still ends up too large for the log or the cache, the journal is aborted
+ * rather than writing anything home out of order : nothing more is committed, the held blocks are dropped,
+ * no call begins any more and the next mount replays the log up to the last transaction that was.
+ *
+ * Block 0 of the region is the journal header, transactions follow from block 1. Each one starts on
+ * a block boundary with a journal_txn_t, followed by its records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "disk_emu.h"
+#include "block_cache.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC           0x4a524e4c  //journal header
+#define JOURNAL_TXN_MAGIC       0x54584e31  //start of a transaction
+#define JOURNAL_GROUP_OPS       16          //sfs_* calls committed together
+#define JOURNAL_OP_HOLD         16          //cache frames an sfs_* call can count on holding
+#define JOURNAL_OP_LOG          2           //log blocks its records can count on taking
+
+//journal header, first block of the region
+typedef struct _journal_hdr_t{
+    int magic;
+    int start;          //block (in the region) of the first transaction to replay
+    int seq;            //sequence number of that transaction
+}journal_hdr_t;
+
+//transaction header, followed by nbytes of records
+typedef struct _journal_txn_t{
+    int magic;
+    int seq;
+    int nbytes;
+    unsigned int checksum;  //of the records, a torn transaction is not replayed
+}journal_txn_t;
+
+//record header, followed by len bytes to copy at offset off of disk block blk (none for JOURNAL_ZERO/REVOKE)
+typedef struct _journal_rec_t{
+    int blk;
+    int off;
+    int len;
+}journal_rec_t;
+
+//block freed by a JOURNAL_REVOKE record, and where in the log it was freed
+typedef struct _journal_revoke_t{
+    int blk;
+    long pos;
+}journal_revoke_t;
+
+//GLOBAL VARIABLES
+char *jnl_buf = NULL;       //transaction being built (or read back at mount), starts with its journal_txn_t
+long jnl_len = 0;           //bytes used in jnl_buf
+long jnl_cap = 0;           //bytes allocated for jnl_buf, a multiple of the block size
+char *jnl_blk = NULL;       //1 block, for the header and the blocks patched at replay
+int jnl_blk_size = 0;
+int jnl_disk_blks = 0;      //disk size in blocks
+int jnl_loc = 0;            //first block of the region
+int jnl_nblocks = 0;        //blocks in the region, header included
+int jnl_head = 1;           //where the next transaction is written (in the region)
+int jnl_seq = 1;            //sequence number of the next transaction
+int jnl_ops = 0;            //sfs_* calls in the transaction being built
+int jnl_hold_max = 0;       //commit early once this many cache frames are held
+int jnl_group_max = 0;      //commit early once the transaction takes this many blocks, checkpoint when less is left
+journal_stats_t jnl_stats;
+int jnl_active = 0;         //sfs_* calls in progress
+int jnl_committing = 0;     //1 while a transaction is written, calls wait to begin
+int jnl_commit_wanted = 0;  //journal_commit() calls waiting for the calls in progress, new ones wait for them
+int jnl_aborted = 0;        //1 once a transaction could not be logged, nothing is committed any more
+void (*jnl_committed)() = NULL; //called after each commit, what the transaction freed can be reused
+pthread_mutex_t jnl_lock = PTHREAD_MUTEX_INITIALIZER;  //transaction being built and the counters above
+pthread_cond_t jnl_idle = PTHREAD_COND_INITIALIZER;    //a call ended or a commit is done
+
+//helper functions
+
+//FNV-1a hash of the records of a transaction
+static unsigned int jnl_checksum(const char *p, long n){
+    unsigned int h = 2166136261u;
+    for (long i = 0; i < n; i++){
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    }
+    return h;
+}
+
+//makes room for n more bytes in jnl_buf, returns -1 if out of memory
+static int jnl_reserve(long n){
+    if (jnl_len + n <= jnl_cap){
+        return 0;
+    }
+    long cap = jnl_cap ? jnl_cap : jnl_blk_size;
+    while (cap < jnl_len + n){
+        cap = cap * 2;
+    }
+    char *buf = (char *)realloc(jnl_buf, cap);
+    if (buf == NULL){
+        printf("Could not allocate journal buffer\n");
+        return -1;
+    }
+    jnl_buf = buf;
+    jnl_cap = cap;
+    return 0;
+}
+
+//blocks taken in the log by a transaction holding nbytes of records
+static int jnl_txn_blocks(long nbytes){
+    return (int)((sizeof(journal_txn_t) + nbytes + jnl_blk_size - 1) / jnl_blk_size);
+}
+
+//writes the journal header, the log is replayed from block start with sequence number seq
+static int jnl_write_hdr(int start, int seq){
+    journal_hdr_t *hdr = (journal_hdr_t *)jnl_blk;
+    memset(jnl_blk, 0, jnl_blk_size);
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->start = start;
+    hdr->seq = seq;
+    if (write_blocks(jnl_loc, 1, jnl_blk) < 0){
+        return -1;
+    }
+    flush_disk();
+    return 0;
+}
+
+//reads the transaction at block pos of the region into jnl_buf
+//returns the number of blocks it takes, 0 if there is no valid transaction seq there
+static int jnl_read_txn(int pos, int seq){
+    if (pos < 1 || pos >= jnl_nblocks){
+        return 0;
+    }
+    jnl_len = 0;
+    if (jnl_reserve(jnl_blk_size) < 0 || read_blocks(jnl_loc + pos, 1, jnl_buf) < 0){
+        return 0;
+    }
+    journal_txn_t txn = *(journal_txn_t *)jnl_buf;
+    if (txn.magic != JOURNAL_TXN_MAGIC || txn.seq != seq || txn.nbytes < 0
+        || txn.nbytes > (long)(jnl_nblocks - pos) * jnl_blk_size){
+        return 0;
+    }
+    int nblks = jnl_txn_blocks(txn.nbytes);
+    if (pos + nblks > jnl_nblocks || jnl_reserve((long)nblks * jnl_blk_size) < 0){
+        return 0;
+    }
+    if (nblks > 1 && read_blocks(jnl_loc + pos + 1, nblks - 1, jnl_buf + jnl_blk_size) < 0){
+        return 0;
+    }
+    if (jnl_checksum(jnl_buf + sizeof(journal_txn_t), txn.nbytes) != txn.checksum){
+        return 0;   //torn write, the transaction never committed
+    }
+    jnl_len = sizeof(journal_txn_t) + txn.nbytes;
+    return nblks;
+}
+
+//returns the record at byte off of the transaction in jnl_buf and moves off past it, NULL at the end
+static journal_rec_t *jnl_next_rec(long *off){
+    if (*off + (long)sizeof(journal_rec_t) > jnl_len){
+        return NULL;
+    }
+    journal_rec_t *rec = (journal_rec_t *)(jnl_buf + *off);
+    long len = rec->len > 0 ? rec->len : 0;
+    if (*off + (long)sizeof(journal_rec_t) + len > jnl_len){
+        return NULL;
+    }
+    *off = *off + sizeof(journal_rec_t) + len;
+    return rec;
+}
+
+//order revoked blocks by block number
+static int cmp_revoke(const void *a, const void *b){
+    const journal_revoke_t *x = (const journal_revoke_t *)a;
+    const journal_revoke_t *y = (const journal_revoke_t *)b;
+    if (x->blk != y->blk){
+        return x->blk < y->blk ? -1 : 1;
+    }
+    return x->pos < y->pos ? -1 : (x->pos > y->pos);
+}
+
+//returns 1 if blk is revoked later in the log than position pos
+static int jnl_revoked(journal_revoke_t *revokes, int nrevokes, int blk, long pos){
+    int lo = 0;
+    int hi = nrevokes;
+    while (lo < hi){    //first revoke of a block >= blk
+        int mid = (lo + hi) / 2;
+        if (revokes[mid].blk < blk){
+            lo = mid + 1;
+        }else{
+            hi = mid;
+        }
+    }
+    while (lo < nrevokes && revokes[lo].blk == blk){
+        if (revokes[lo].pos > pos){
+            return 1;
+        }
+        lo++;
+    }
+    return 0;
+}
+
+//returns 1 if the transaction being built has room for n more calls taking their whole share
+static int jnl_fits(int n){
+    return cache_held() + n * JOURNAL_OP_HOLD <= jnl_hold_max
+        && jnl_txn_blocks(jnl_len - sizeof(journal_txn_t)) + n * JOURNAL_OP_LOG <= jnl_group_max;
+}
+
+//same, also counting the calls that are grouped in a transaction
+static int jnl_room(int n){
+    return jnl_ops + n <= JOURNAL_GROUP_OPS && jnl_fits(n);
+}
+
+//stops committing, the held blocks never reach their home location and the log is left for the next mount
+//no call begins any more, the file system is read-only until it is mounted again
+static void jnl_abort(const char *why){
+    pthread_mutex_lock(&jnl_lock);
+    if (!jnl_aborted){
+        printf("Journal aborted, %s\n", why);
+    }
+    jnl_aborted = 1;
+    pthread_mutex_unlock(&jnl_lock);
+}
+
+//copies a logged record onto its home block through the cache
+static void jnl_apply(journal_rec_t *rec){
+    if (rec->blk < 0 || rec->blk >= jnl_disk_blks){
+        return;
+    }
+    if (rec->len == JOURNAL_ZERO){
+        memset(jnl_blk, 0, jnl_blk_size);
+    }else if (rec->len >= 0 && rec->off >= 0 && rec->off + rec->len <= jnl_blk_size){
+        cache_read_blocks(rec->blk, 1, jnl_blk);
+        memcpy(jnl_blk + rec->off, (char *)rec + sizeof(journal_rec_t), rec->len);
+    }else{
+        return;
+    }
+    cache_write_blocks(rec->blk, 1, jnl_blk);
+    jnl_stats.replayed++;
+}
+
+
+/*------------------------------------------------------------------*/
+/*Sets up the journal in blocks [loc, loc+nblocks) of the disk,     */
+/*committed is called once each transaction is in the log           */
+/*------------------------------------------------------------------*/
+int journal_init(int block_size, int disk_blocks, int loc, int nblocks, int hold_max, void (*committed)())
+{
+    free(jnl_buf);
+    free(jnl_blk);
+    jnl_buf = NULL;
+    jnl_cap = 0;
+    jnl_blk_size = block_size;
+    jnl_disk_blks = disk_blocks;
+    jnl_loc = loc;
+    jnl_nblocks = nblocks;
+    jnl_hold_max = hold_max;
+    jnl_committed = committed;
+    jnl_group_max = (nblocks - 1) / 2 > 0 ? (nblocks - 1) / 2 : 1;
+    jnl_head = 1;
+    jnl_seq = 1;
+    jnl_ops = 0;
+    jnl_len = 0;
+    jnl_blk = (char *)malloc(block_size);
+    if (jnl_blk == NULL || jnl_reserve(block_size) < 0){
+        printf("Could not allocate journal\n");
+        return -1;
+    }
+    jnl_len = sizeof(journal_txn_t);
+    jnl_aborted = 0;
+    memset(&jnl_stats, 0, sizeof(jnl_stats));
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes an empty log on a new file system                           */
+/*------------------------------------------------------------------*/
+int journal_format()
+{
+    jnl_head = 1;
+    jnl_seq = 1;
+    return jnl_write_hdr(jnl_head, jnl_seq);
+}
+
+/*------------------------------------------------------------------*/
+/*Applies the committed transactions to their home blocks, then      */
+/*empties the log. Call at mount before reading any metadata         */
+/*------------------------------------------------------------------*/
+int journal_replay()
+{
+    if (read_blocks(jnl_loc, 1, jnl_blk) < 0){
+        return -1;
+    }
+    journal_hdr_t hdr = *(journal_hdr_t *)jnl_blk;
+    if (hdr.magic != JOURNAL_MAGIC){
+        printf("No valid journal found, starting an empty one\n");
+        return journal_format();
+    }
+
+    //first pass, collect the revoked blocks and where they were revoked
+    journal_revoke_t *revokes = NULL;
+    int nrevokes = 0;
+    int cap = 0;
+    long pos = 0;   //position of a record in the whole log
+    int blk = hdr.start;
+    int seq = hdr.seq;
+    int nblks;
+    while ((nblks = jnl_read_txn(blk, seq)) > 0){
+        long off = sizeof(journal_txn_t);
+        journal_rec_t *rec;
+        while ((rec = jnl_next_rec(&off)) != NULL){
+            if (rec->len == JOURNAL_REVOKE){
+                if (nrevokes == cap){
+                    cap = cap ? cap * 2 : 64;
+                    journal_revoke_t *r = (journal_revoke_t *)realloc(revokes, sizeof(journal_revoke_t) * cap);
+                    if (r == NULL){
+                        free(revokes);
+                        printf("Could not allocate journal revoke table\n");
+                        return -1;
+                    }
+                    revokes = r;
+                }
+                revokes[nrevokes].blk = rec->blk;
+                revokes[nrevokes].pos = pos;
+                nrevokes++;
+            }
+            pos++;
+        }
+        blk = blk + nblks;
+        seq++;
+    }
+    if (nrevokes > 0){
+        qsort(revokes, nrevokes, sizeof(journal_revoke_t), cmp_revoke);
+    }
+
+    //second pass, apply in log order what was not revoked afterwards
+    pos = 0;
+    blk = hdr.start;
+    seq = hdr.seq;
+    while ((nblks = jnl_read_txn(blk, seq)) > 0){
+        long off = sizeof(journal_txn_t);
+        journal_rec_t *rec;
+        while ((rec = jnl_next_rec(&off)) != NULL){
+            if (rec->len != JOURNAL_REVOKE && !jnl_revoked(revokes, nrevokes, rec->blk, pos)){
+                jnl_apply(rec);
+            }
+            pos++;
+        }
+        blk = blk + nblks;
+        seq++;
+    }
+    free(revokes);
+    if (seq != hdr.seq){
+        printf("Journal replayed %d transactions\n", seq - hdr.seq);
+    }
+
+    //the home blocks are up to date once written back, the log can start over
+    int res = cache_sync();
+    flush_disk();
+    jnl_head = 1;
+    jnl_seq = seq;
+    jnl_len = sizeof(journal_txn_t);
+    jnl_ops = 0;
+    if (jnl_write_hdr(jnl_head, jnl_seq) < 0){
+        res = -1;
+    }
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Logs len bytes written at offset off of disk block blk             */
+/*------------------------------------------------------------------*/
+void journal_record(int blk, int off, int len, const void *bytes)
+{
+    if (jnl_blk == NULL){
+        return;
+    }
+    long n = len > 0 ? len : 0;
+    pthread_mutex_lock(&jnl_lock);
+    if (jnl_aborted || jnl_reserve(sizeof(journal_rec_t) + n) < 0){ //nothing will be committed, or out of memory
+        pthread_mutex_unlock(&jnl_lock);
+        return;
+    }
+    journal_rec_t *rec = (journal_rec_t *)(jnl_buf + jnl_len);
+    rec->blk = blk;
+    rec->off = off;
+    rec->len = len;
+    if (n > 0){
+        memcpy(jnl_buf + jnl_len + sizeof(journal_rec_t), bytes, n);
+    }
+    jnl_len = jnl_len + sizeof(journal_rec_t) + n;
+    jnl_stats.records++;
+    pthread_mutex_unlock(&jnl_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a logged metadata block into the cache, where it is held    */
+/*until its transaction commits                                      */
+/*------------------------------------------------------------------*/
+void journal_write_block(int blk, void *block)
+{
+    if (jnl_blk == NULL){
+        cache_write_blocks(blk, 1, block);
+    }else if (cache_write_held(blk, 0, jnl_blk_size, block) < 0){ //written and held at once, it cannot be evicted in between
+        jnl_abort("every cache frame is held");
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Logs len bytes written at offset off of metadata block blk and     */
+/*writes only them into the cached block, the rest of which may be   */
+/*changed by other calls                                             */
+/*------------------------------------------------------------------*/
+void journal_write_bytes(int blk, int off, int len, const void *bytes)
+{
+    journal_record(blk, off, len, bytes);
+    if (cache_write_held(blk, off, len, bytes) < 0){
+        jnl_abort("every cache frame is held");
+    }
+    if (jnl_blk == NULL){   //no commit to wait for
+        cache_release();
+    }
+}
+
+//writes the transaction being built to the log, the caller has it to itself (no call in progress)
+static int jnl_commit(){
+    if (jnl_blk == NULL){
+        return 0;
+    }
+    long nbytes = jnl_len - sizeof(journal_txn_t);
+    jnl_ops = 0;
+    if (jnl_aborted){
+        jnl_len = sizeof(journal_txn_t);
+        cache_drop_held();  //never written home, later reads get the last committed copy
+        return -1;
+    }
+    if (nbytes == 0){
+        return 0;
+    }
+    int nblks = jnl_txn_blocks(nbytes);
+    int res = 0;
+    if (jnl_head + nblks > jnl_nblocks){
+        //the calls logged more than the log has room for, their blocks are dropped rather than written home out of order
+        jnl_abort("transaction larger than the log");
+        cache_drop_held();
+        res = -1;
+    }else{
+        if (jnl_reserve((long)nblks * jnl_blk_size - jnl_len) < 0){
+            return -1;
+        }
+        memset(jnl_buf + jnl_len, 0, (long)nblks * jnl_blk_size - jnl_len);
+        journal_txn_t *txn = (journal_txn_t *)jnl_buf;
+        txn->magic = JOURNAL_TXN_MAGIC;
+        txn->seq = jnl_seq;
+        txn->nbytes = (int)nbytes;
+        txn->checksum = jnl_checksum(jnl_buf + sizeof(journal_txn_t), nbytes);
+        if (write_blocks(jnl_loc + jnl_head, nblks, jnl_buf) < 0){
+            return -1;
+        }
+        flush_disk();   //the log is in the disk file before any held block can be written home
+        jnl_head = jnl_head + nblks;
+        jnl_seq++;
+        jnl_stats.commits++;
+        jnl_stats.log_blocks += nblks;
+        cache_release();
+        if (jnl_committed != NULL){
+            jnl_committed();
+        }
+        if (jnl_nblocks - jnl_head < jnl_group_max){    //start over while nothing is held
+            res = journal_checkpoint();
+        }
+    }
+    jnl_len = sizeof(journal_txn_t);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Starts an sfs_* call that changes metadata, waits while a commit   */
+/*is in progress or the transaction has no room left for its share.  */
+/*Call before taking any file system lock. Returns -1 once the       */
+/*journal was aborted : the call must end without changing anything  */
+/*------------------------------------------------------------------*/
+int journal_begin_op()
+{
+    pthread_mutex_lock(&jnl_lock);
+    while (jnl_committing || jnl_commit_wanted > 0 || (jnl_active > 0 && !jnl_room(jnl_active + 1))){
+        pthread_cond_wait(&jnl_idle, &jnl_lock);
+    }
+    jnl_active++;
+    int res = jnl_aborted ? -1 : 0;
+    pthread_mutex_unlock(&jnl_lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Ends an sfs_* call, the last one out commits once enough calls are */
+/*grouped (or drops the held blocks once the journal was aborted)    */
+/*------------------------------------------------------------------*/
+int journal_end_op()
+{
+    pthread_mutex_lock(&jnl_lock);
+    jnl_ops++;
+    jnl_active--;
+    int commit = jnl_active == 0 && jnl_commit_wanted == 0 && (!jnl_room(1) || (jnl_aborted && cache_held() > 0));
+    if (!commit){
+        pthread_cond_broadcast(&jnl_idle);
+        pthread_mutex_unlock(&jnl_lock);
+        return 0;
+    }
+    jnl_committing = 1;
+    pthread_mutex_unlock(&jnl_lock);
+
+    int res = jnl_commit();
+    pthread_mutex_lock(&jnl_lock);
+    jnl_committing = 0;
+    pthread_cond_broadcast(&jnl_idle);
+    pthread_mutex_unlock(&jnl_lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns 1 once the calls in progress have used the room of the     */
+/*transaction, a call that goes on changing metadata past its share  */
+/*should then end and go on in a new one                             */
+/*------------------------------------------------------------------*/
+int journal_op_full()
+{
+    if (jnl_blk == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&jnl_lock);
+    int full = !jnl_fits(jnl_active);
+    pthread_mutex_unlock(&jnl_lock);
+    return full;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes the transaction being built to the log in one request, once */
+/*the calls in progress have ended                                   */
+/*------------------------------------------------------------------*/
+int journal_commit()
+{
+    pthread_mutex_lock(&jnl_lock);
+    jnl_commit_wanted++;
+    while (jnl_committing || jnl_active > 0){
+        pthread_cond_wait(&jnl_idle, &jnl_lock);
+    }
+    jnl_commit_wanted--;
+    jnl_committing = 1;
+    pthread_mutex_unlock(&jnl_lock);
+
+    int res = jnl_commit();
+    pthread_mutex_lock(&jnl_lock);
+    jnl_committing = 0;
+    pthread_cond_broadcast(&jnl_idle);
+    pthread_mutex_unlock(&jnl_lock);
+    return res;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes the committed blocks home and empties the log, call when    */
+/*no block is held                                                   */
+/*------------------------------------------------------------------*/
+int journal_checkpoint()
+{
+    if (cache_sync() < 0){
+        return -1;
+    }
+    flush_disk();
+    jnl_head = 1;
+    jnl_stats.checkpoints++;
+    return jnl_write_hdr(jnl_head, jnl_seq);
+}
+
+/*------------------------------------------------------------------*/
+/*Commits and checkpoints what is pending, then releases the journal */
+/*------------------------------------------------------------------*/
+int journal_close()
+{
+    if (jnl_blk == NULL){
+        return 0;
+    }
+    int res = journal_commit();
+    if (!jnl_aborted && journal_checkpoint() < 0){  //an aborted log is left as it is for the next mount
+        res = -1;
+    }
+    free(jnl_buf);
+    free(jnl_blk);
+    jnl_buf = NULL;
+    jnl_blk = NULL;
+    jnl_cap = 0;
+    jnl_len = 0;
+    return res;
+}
+
+//copies the journal counters
+void journal_get_stats(journal_stats_t *stats){
+    *stats = jnl_stats;
+}
@@ -0,0 +1,30 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_ZERO            -1      //record length of a block cleared to 0s, carries no bytes
+#define JOURNAL_REVOKE          -2      //record length of a block freed, earlier records for it are not replayed
+
+//counters of the metadata journal
+typedef struct _journal_stats_t{
+    long records;       //records logged
+    long commits;       //transactions written to the log
+    long log_blocks;    //blocks written to the log
+    long checkpoints;   //times the log was emptied
+    long replayed;      //records applied at mount
+}journal_stats_t;
+
+int journal_init(int block_size, int disk_blocks, int loc, int nblocks, int hold_max, void (*committed)());
+int journal_format();
+int journal_replay();
+void journal_record(int blk, int off, int len, const void *bytes);
+void journal_write_block(int blk, void *block);
+void journal_write_bytes(int blk, int off, int len, const void *bytes);
+int journal_begin_op();
+int journal_end_op();
+int journal_op_full();
+int journal_commit();
+int journal_checkpoint();
+int journal_close();
+void journal_get_stats(journal_stats_t *stats);
+
+#endif
@@ -6,29 +6,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
 #include "disk_emu.c"
+#include "block_cache.h"
+#include "block_cache.c"
+#include "journal.h"
+#include "journal.c"
 #include <math.h> //run with lm flag
 
 
 //CONSTANTS
-#define BLOCK_SIZE              1024     //block size in bytes
 #define AVG_FILE_SIZE           10       //average file size in blocks
-#define MAX_FILE_NUM            100      //max number of files /SET TO 150 LATER?
-#define DIR_SIZE                10      //1024/64 byte entries = 16 entries/block, 150/16 = 10
-#define INODE_TBL_SIZE          10      //16 fields * 4 bytes each = 64 bytes/inode, 150/(1024/64)=10
-#define FBM_SIZE                2       //Free bitmap, 1511 blocks total, 1511/1024 = 2 
-
-#define TOTAL_INODE_ENTRIES     160      //should be 64 byte entries, 16 entries/block, 16*inode_block_number entries, 16*10 = 160
-
-#define FILE_SYST_SIZE          2000     //32 for now(debugging purposes), can be set to 1513 or 2000 later?         
+#define DEFAULT_BLOCK_SIZE      1024     //geometry used by mksfs(1), block size in bytes
+#define DEFAULT_FILE_SYST_SIZE  2000     //disk size in blocks
+#define DEFAULT_INODE_NUM       160      //64 byte inodes, 16 per block -> 10 blocks of inode table
+#define MIN_BLOCK_SIZE          512      //smallest block size accepted by sfs_mkfs, also used to probe the superblock
+#define MAX_BLOCK_SIZE          65536    //largest block size accepted by sfs_mkfs
+#define SFS_MAGIC               28980674 //magic number reference in document
+
+#define CACHE_SIZE              256      //number of block frames in the buffer cache
+#define WRITE_AROUND_BLKS       32       //runs of whole blocks at least this long are written by sfs_fwrite straight to disk
+#define WRITE_BUFFER_BLKS       32       //write buffer of a descriptor, writes smaller than it are gathered there
+#define WRITE_BUFFER_TOTAL_BLKS 1024     //memory all the write buffers may use, writes go straight to the cache past it
+#define READ_AHEAD_MIN          4        //blocks read ahead once a descriptor reads sequentially
+#define READ_AHEAD_MAX          64       //the window doubles up to this many blocks while the reads stay sequential
+#define MIN_JOURNAL_SIZE        8        //#blks of the metadata journal, 1/64 of the disk within these bounds
+#define MAX_JOURNAL_SIZE        1024
 
 #define APPEND_MODE             1       //pointer at the end of the file
 #define UNUSED_MODE             0       //file is not present in ofdt
 #define SEEK_MODE               2       //pointer has been seeked
 
-#define MAXFILENAME             32      
+#define NUM_DIRECT              10      //direct pointers in an inode
+#define OP_MAX_INODES           4       //inodes an sfs_* call can modify before they are flushed
 
 #define LOG                     0       //to print values
 
@@ -36,11 +50,6 @@
 
 //STRUCTURES
 
-//block type structure definition
-typedef struct _block_t{
-    char data[BLOCK_SIZE];
-}block_t;
-
 //super block type structure definition
 typedef struct _superblock_t{ 
     //each entry is 4 bytes
@@ -53,16 +62,20 @@ typedef struct _superblock_t{
     int inodetbl_loc;           //inode table location (block index)
     int fbm_loc;                //fbm locaiton (block index)
     int root_inode_num;         //inode #  used for rood directory 
+    int journal_loc;            //metadata journal location (block index), data blocks follow it
+    int journal_size;           //#blks used for the journal
 }superblock_t;
 
 //i-node entry type structure definition
 typedef struct _inode_t{
-    //16 fields with 4 bytes each => 64 bytes
-    int mode; //append mode = 1
-    int link_cnt;
-    int size;      //in bytes 
-    int pointers[12];//assume pointers to file blocks are indices (int) so they take up 4 bytes
-    int ind_pointer;
+    //8 + 2*2 + 13*4 => 64 bytes
+    int64_t size;      //in bytes 
+    short mode; //append mode = 1
+    short link_cnt;
+    int pointers[NUM_DIRECT];//assume pointers to file blocks are indices (int) so they take up 4 bytes
+    int ind_pointer;    //block of pointers to data blocks
+    int dind_pointer;   //block of pointers to indirect blocks
+    int tind_pointer;   //block of pointers to double indirect blocks
 }inode_t;
 
 //i-node table type structure definition 
@@ -81,92 +94,732 @@ typedef struct _indirect_ptrs_t{ //1024/4 = 256 pointers per block
     int ptr;
 }indirect_ptrs_t;
 
-typedef struct _fbm_map_t{
-    char available;  //1 for available , 0 for unavailable
-}fbm_map_t;
+//free bitmap word, bit b of word w describes block 64*w+b (1 for available , 0 for unavailable)
+typedef unsigned long long fbm_word_t;
+#define FBM_WORD_BITS           64
+#define FBM_WORDS_PER_BLK       (BLOCK_SIZE / sizeof(fbm_word_t))
+#define FREE_MAP_WORDS(n)       (((n) + FBM_WORD_BITS - 1) / FBM_WORD_BITS)     //words in an in-memory free map of n entries
+
+//filename hash table entry (open addressing, linear probing)
+typedef struct _dir_hash_t{
+    int dir_entry_num;  //index of the entry in the directory, -1 if the slot is empty
+    int inode;          //inode number of the file
+}dir_hash_t;
 
-typedef struct _ofdt_t{ //8byte entries
+typedef struct _ofdt_t{
     int inode;  //inode index of this file
-    int offset; //read and write pointer (in bytes?)
+    int64_t offset; //read and write pointer (in bytes?)
+    int *blk_map;       //file block -> disk block, -1 until looked up (filled lazily, only in memory)
+    int blk_map_len;    //number of file blocks blk_map covers
+    pthread_mutex_t lock;   //serializes the reads through this entry's offset, they share the inode lock
+    pthread_mutex_t map_lock;   //block map, filled by readers sharing the inode lock, and read-ahead state
+    int64_t ra_next;    //offset the next read starts at if the file is read sequentially
+    int ra_window;      //blocks read ahead, 0 while the reads are not sequential
+    int ra_end;         //file block the read-ahead has been issued up to (excluded)
+    char *wbuf;         //data written but not assigned blocks yet, WRITE_BUFFER_BLKS blocks, NULL until needed
+    int64_t wbuf_off;   //file offset of the first byte of wbuf
+    int wbuf_len;       //bytes in wbuf
+    int wbuf_resv;      //free blocks reserved so the buffered data is sure to find room when flushed
+    int64_t map_off;    //file offset of the write mapping in progress, -1 if none (see sfs_map)
+    int map_count;      //mappings in progress, a write mapping is always the only one (lock)
 }ofdt_t;
 
+//state of the sfs_fwrite call in progress
+typedef struct _write_ctx_t{
+    int fd;             //descriptor the file is written through
+    int inode_num;      //inode of the file being written
+    int ext_next;       //next unused block of the extent reserved for this write
+    int ext_left;       //number of unused blocks left in that extent
+    int leaf_first;     //first file block described by the indirect block being updated, -1 if none
+    int leaf_blk;       //disk block of that indirect block
+    int leaf_dirty;     //1 if its pointers changed in the block map and it has to be written back
+    int leaf_lo;        //first and last pointer of the leaf that changed, logged in the journal
+    int leaf_hi;
+}write_ctx_t;
+
 typedef struct _data_t{
     char character;  //1 byte entries
 }data_t;
 
-
-
-//GLOBAL VARIABLES (blocks in memory)
-block_t superblock_mem[1];                  // super block (composed of 1 block)
-block_t inode_tbl_mem[INODE_TBL_SIZE];      //inode table 
-block_t dir_mem[DIR_SIZE*11];               // root directory (limit to 10 blocks/directory)
-block_t fbm_map_mem[FBM_SIZE];              //free bit map
-block_t indirect_ptrs_mem[1];               //1 block of indirect pointers
-block_t data_blk_mem[BLOCK_SIZE];           //datablock 
-ofdt_t ofdt[MAX_FILE_NUM];                  //open file descriptor table
+//buffers of a thread, so calls on different files do not share scratch memory
+typedef struct _scratch_t{
+    int size;                   //block size the buffers are allocated for
+    char *indirect_ptrs_mem;    //1 block of indirect pointers
+    char *data_blk_mem;         //datablock
+    int dirty_inodes[OP_MAX_INODES];    //inodes modified by the sfs_* call in progress, logged by flush_inode_tbl
+    int ndirty;
+    int resv;                   //reserved blocks the write buffer being flushed may take
+    int resv_taken;             //blocks of that reservation allocated so far, given back with unused extent blocks
+}scratch_t;
+
+
+
+//GEOMETRY (set by sfs_mkfs or read from the superblock at mount, BLOCK_SIZE is shared with disk_emu.c)
+int FILE_SYST_SIZE;         //disk size in blocks
+int INODE_TBL_SIZE;         //#blks used for the inode table
+int FBM_SIZE;               //#blks used for the free bitmap, 1 bit per block
+int JOURNAL_SIZE;           //#blks used for the metadata journal
+int TOTAL_INODE_ENTRIES;    //64 byte entries, BLOCK_SIZE/64 per inode table block
+int MAX_FILE_NUM;           //max number of files, every inode but the directory's
+int DIR_SIZE;               //#blks holding the directory entries
+int DIR_HASH_SIZE;          //slots in the filename hash table, power of 2 and at least 2*MAX_FILE_NUM
+int PTRS_PER_BLK;           //pointers in an indirect block
+int MAX_FILE_BLKS;          //direct + single, double and triple indirect, capped to fit an int
+
+//GLOBAL VARIABLES (blocks in memory, allocated for the geometry by alloc_tables)
+char *superblock_mem = NULL;                // super block (composed of 1 block)
+char *inode_tbl_mem = NULL;                 //inode table 
+char *dir_mem = NULL;                       // root directory
+char *fbm_map_mem = NULL;                   //free bit map
+char *zero_blk_mem = NULL;                  //block of 0s used to clear new indirect blocks
+ofdt_t *ofdt = NULL;                        //open file descriptor table
+char *fbm_dirty = NULL;                     //1 if the free bitmap block was modified since the last flush
+fbm_word_t *fbm_word_dirty = NULL;          //1 bit per fbm word modified since the last flush
+fbm_word_t *fbm_pending = NULL;             //1 bit per block freed by the transaction being built, not allocated before it commits
+dir_hash_t *dir_hash = NULL;                //filename -> directory entry, rebuilt at mount
+fbm_word_t *inode_free = NULL;              //1 bit per inode, 1 for unused
+fbm_word_t *ofdt_free = NULL;               //1 bit per ofdt entry, 1 for unused
+fbm_word_t *dir_free = NULL;                //1 bit per directory entry, 1 for unused
+int *inode_fd = NULL;                       //ofdt entry the inode is open in, -1 if it is not open
+pthread_rwlock_t *inode_locks = NULL;       //1 per inode : its fields, its data and the ofdt entry it is open in
+
+//LOCKS (taken in this order : journal_begin_op, inode, directory, allocator)
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;      //directory, filename hash, free inode/directory/ofdt maps, inode_fd and which inode an ofdt entry holds
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;    //free bitmap, its dirty maps, the next-fit cursor and the write buffer reservations
+pthread_key_t scratch_key;                                  //scratch_t of each thread
+pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
 
 
 //variables
 int fbm_loc;            //fbm location on disk (in blks)
 int inodetbl_loc;       //inode table location on disk (in blks)
+int journal_loc;        //metadata journal location on disk
 int data_loc;           //data blocks location on disk
 int directory_inode;    //inode number attributed to directory (should be 0)
 int current_file;       //pointer used to iterate through files in directory
+int fbm_cursor;         //next-fit cursor, fbm word where the last block was allocated
+int fbm_nfree;          //available blocks in the fbm
+int fbm_npending;       //available blocks in fbm_pending, which cannot be allocated yet
+int wbuf_reserved;      //available blocks reserved by the write buffers
+long wbuf_mem;          //bytes allocated to write buffers
+int cache_exit_set = 0; //1 once the cache flush has been registered with atexit
 
 //helper functions
 
+int min(int x, int y);
+
+//frees the scratch buffers of a thread that exits
+void scratch_free(void *p){
+    scratch_t *sc = (scratch_t *)p;
+    free(sc->indirect_ptrs_mem);
+    free(sc->data_blk_mem);
+    free(sc);
+}
+
+void scratch_key_create(){
+    pthread_key_create(&scratch_key, scratch_free);
+}
+
+//returns the scratch buffers of the calling thread, (re)allocated for the current block size
+scratch_t *get_scratch(){
+    pthread_once(&scratch_once, scratch_key_create);
+    scratch_t *sc = (scratch_t *)pthread_getspecific(scratch_key);
+    if (sc == NULL){
+        sc = (scratch_t *)calloc(1, sizeof(scratch_t));
+        pthread_setspecific(scratch_key, sc);
+    }
+    if (sc->size != BLOCK_SIZE){
+        free(sc->indirect_ptrs_mem);
+        free(sc->data_blk_mem);
+        sc->indirect_ptrs_mem = (char *)calloc(1, BLOCK_SIZE);
+        sc->data_blk_mem = (char *)calloc(1, BLOCK_SIZE);
+        sc->size = BLOCK_SIZE;
+    }
+    return sc;
+}
+
+//returns 1 if the block is marked as available in the fbm
+int fbm_is_free(int blk){
+    fbm_word_t *fbm_map = (fbm_word_t *)fbm_map_mem;
+    return (fbm_map[blk / FBM_WORD_BITS] >> (blk % FBM_WORD_BITS)) & 1;
+}
+
+//mark block as available (1) or unavailable (0) and remember which fbm block changed
+void fbm_set(int blk, int available){
+    if (blk < 0 || blk >= FILE_SYST_SIZE){  //a block number read from a damaged disk
+        return;
+    }
+    fbm_word_t *fbm_map = (fbm_word_t *)fbm_map_mem;
+    fbm_word_t bit = (fbm_word_t)1 << (blk % FBM_WORD_BITS);
+    int was = (fbm_map[blk / FBM_WORD_BITS] & bit) != 0;
+    if (available){
+        fbm_map[blk / FBM_WORD_BITS] |= bit;
+    }else{
+        fbm_map[blk / FBM_WORD_BITS] &= ~bit;
+    }
+    fbm_nfree = fbm_nfree + (available != 0) - was;
+    fbm_dirty[blk / FBM_WORD_BITS / FBM_WORDS_PER_BLK] = 1;
+    fbm_word_dirty[blk / FBM_WORD_BITS / FBM_WORD_BITS] |= (fbm_word_t)1 << (blk / FBM_WORD_BITS % FBM_WORD_BITS);
+}
+
+//returns 1 if ptr is a data block number an inode or an indirect block can hold (0 is unassigned)
+int data_blk_valid(int ptr){
+    return ptr > 0 && ptr < fbm_loc - data_loc;
+}
+
+//frees data block ptr for the transaction being built, call with alloc_lock held
+//the fbm it logs has the block available, but it is not allocated again before that transaction commits :
+//new data is written home right away, and a crash before the commit brings back the file that used it
+void fbm_free(int ptr){
+    int blk = data_loc + ptr;
+    if (!data_blk_valid(ptr) || fbm_is_free(blk)){
+        return;
+    }
+    fbm_pending[blk / FBM_WORD_BITS] |= (fbm_word_t)1 << (blk % FBM_WORD_BITS);
+    fbm_npending++;
+    fbm_set(blk, 1);
+}
+
+//the transaction that freed the pending blocks committed, they can be allocated again
+void fbm_release_pending(){
+    pthread_mutex_lock(&alloc_lock);
+    if (fbm_npending > 0){
+        memset(fbm_pending, 0, FREE_MAP_WORDS(FILE_SYST_SIZE) * sizeof(fbm_word_t));
+        fbm_npending = 0;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+//blocks the calling thread may allocate, the pending ones and the ones reserved by write buffers are left out
+//unless it is flushing one, call with alloc_lock held
+int alloc_avail(){
+    return fbm_nfree - fbm_npending - (wbuf_reserved - get_scratch()->resv);
+}
+
+//counts n allocated blocks against the reservation of the write buffer the thread is flushing
+void alloc_take(int n){
+    scratch_t *scratch = get_scratch();
+    int take = min(n, scratch->resv);
+    scratch->resv = scratch->resv - take;
+    scratch->resv_taken = scratch->resv_taken + take;
+    wbuf_reserved = wbuf_reserved - take;
+}
+
 // function looks at fbm and assigns a new block based on availability
+// scans a word (64 blocks) at a time starting at the next-fit cursor
 //returns disk_blk_num
 int find_free_block(){
-    int disk_blk_num=0;
-    int fbm_index = 0; //fbm index of new block assigned
-    fbm_map_t *fbm_map = (fbm_map_t *)fbm_map_mem;
-    for (int fb = 0; fb < FILE_SYST_SIZE; fb++){
-        if (fbm_map[fb].available){ //if there is an availble block, assign this one as new disk memory block
-            fbm_index = fb;
-            fbm_map[fb].available = 0; //mark as unavailable
-            break;
+    fbm_word_t *fbm_map = (fbm_word_t *)fbm_map_mem;
+    int nwords = (FILE_SYST_SIZE + FBM_WORD_BITS - 1) / FBM_WORD_BITS;
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < nwords && alloc_avail() > 0; i++){
+        int w = (fbm_cursor + i) % nwords;
+        fbm_word_t word = fbm_map[w] & ~fbm_pending[w];
+        if (word){ //at least one block in this word can be allocated
+            int fbm_index = w * FBM_WORD_BITS + __builtin_ctzll(word);
+            fbm_set(fbm_index, 0); //mark as unavailable
+            alloc_take(1);
+            fbm_cursor = w;
+            pthread_mutex_unlock(&alloc_lock);
+            return fbm_index - data_loc; //convert from fbm index to data block index(start at 0 with first data block) 
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return -1; //no more available blocks
+}
+
+//returns the first block in [from, end) that can be allocated (available 1) or not (available 0), end if none
+int fbm_scan(int from, int end, int available){
+    fbm_word_t *fbm_map = (fbm_word_t *)fbm_map_mem;
+    int b = from;
+    while (b < end){
+        fbm_word_t word = fbm_map[b / FBM_WORD_BITS] & ~fbm_pending[b / FBM_WORD_BITS];
+        if (!available){
+            word = ~word;
+        }
+        word = word >> (b % FBM_WORD_BITS); //ignore the bits before b
+        if (word){
+            b = b + __builtin_ctzll(word);
+            return b < end ? b : end;
+        }
+        b = (b / FBM_WORD_BITS + 1) * FBM_WORD_BITS; //skip to the next word
+    }
+    return end;
+}
+
+// reserves up to nblocks contiguous blocks in one pass over the fbm (next-fit)
+// takes the first run that is long enough, otherwise the longest run found
+//returns disk_blk_num of the first block and the number of blocks reserved in count, -1 if the disk is full
+int find_free_extent(int nblocks, int *count){
+    pthread_mutex_lock(&alloc_lock);
+    nblocks = min(nblocks, alloc_avail());
+    if (nblocks <= 0){
+        pthread_mutex_unlock(&alloc_lock);
+        *count = 0;
+        return -1;
+    }
+    int start = fbm_cursor * FBM_WORD_BITS;
+    int best = -1;
+    int best_len = 0;
+    for (int pass = 0; pass < 2 && best_len < nblocks; pass++){
+        int from = pass ? 0 : start;             //cursor to the end, then wrap around
+        int end = pass ? start : FILE_SYST_SIZE;
+        int b = fbm_scan(from, end, 1);
+        while (b < end){
+            int e = fbm_scan(b, end, 0);         //end of this run of available blocks
+            if (e - b > best_len){
+                best = b;
+                best_len = e - b;
+                if (best_len >= nblocks){
+                    break;
+                }
+            }
+            b = fbm_scan(e, end, 1);
+        }
+    }
+    if (best < 0){
+        pthread_mutex_unlock(&alloc_lock);
+        *count = 0;
+        return -1;
+    }
+    if (best_len > nblocks){
+        best_len = nblocks;
+    }
+    for (int b = best; b < best + best_len; b++){
+        fbm_set(b, 0); //mark as unavailable
+    }
+    alloc_take(best_len);
+    fbm_cursor = (best + best_len - 1) / FBM_WORD_BITS;
+    pthread_mutex_unlock(&alloc_lock);
+    *count = best_len;
+    return best - data_loc; //convert from fbm index to data block index
+}
+
+//returns the next block of the extent reserved by sfs_fwrite, reserving a new extent
+//of up to `needed` blocks when the current one is used up, -1 if the disk is full
+int next_extent_block(int *ext_next, int *ext_left, int needed){
+    if (*ext_left == 0){
+        *ext_next = find_free_extent(needed, ext_left);
+        if (*ext_next < 0){
+            return -1;
+        }
+    }
+    *ext_left = *ext_left - 1;
+    *ext_next = *ext_next + 1;
+    return *ext_next - 1;
+}
+
+//give back the blocks of an extent that sfs_fwrite did not use
+//the ones taken from the reservation of a write buffer being flushed go back to it
+void release_extent(int ext_next, int ext_left){
+    scratch_t *scratch = get_scratch();
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < ext_left; i++){
+        fbm_set(data_loc + ext_next + i, 1);
+    }
+    int back = min(ext_left, scratch->resv_taken);
+    scratch->resv = scratch->resv + back;
+    scratch->resv_taken = scratch->resv_taken - back;
+    wbuf_reserved = wbuf_reserved + back;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+//write the modified fbm blocks back to disk, logging the runs of modified words
+void flush_fbm(){
+    pthread_mutex_lock(&alloc_lock);
+    for (int b = 0; b < FBM_SIZE; b++){
+        if (fbm_dirty[b]){
+            char *blk_mem = fbm_map_mem + (long)b * BLOCK_SIZE;
+            int first = b * FBM_WORDS_PER_BLK;
+            int run = 0;    //modified words just before w
+            for (int w = first; w <= first + (int)FBM_WORDS_PER_BLK; w++){
+                int dirty = 0;
+                if (w < first + (int)FBM_WORDS_PER_BLK){
+                    fbm_word_t bit = (fbm_word_t)1 << (w % FBM_WORD_BITS);
+                    dirty = (fbm_word_dirty[w / FBM_WORD_BITS] & bit) != 0;
+                    fbm_word_dirty[w / FBM_WORD_BITS] &= ~bit;
+                }
+                if (dirty){
+                    run++;
+                }else if (run){
+                    int off = (w - run - first) * sizeof(fbm_word_t);
+                    journal_record(fbm_loc + b, off, run * sizeof(fbm_word_t), blk_mem + off);
+                    run = 0;
+                }
+            }
+            journal_write_block(fbm_loc + b, blk_mem);
+            fbm_dirty[b] = 0;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+
+//write the inodes modified by the calling thread's sfs_* call back to their inode table blocks, logging them
+//only their own bytes are written, the other inodes of a block may be in the middle of another call
+//called before returning from sfs_* calls, with the locks of those inodes still held
+void flush_inode_tbl(){
+    scratch_t *sc = get_scratch();
+    for (int i = 0; i < sc->ndirty; i++){
+        //an inode straddling 2 blocks is logged and written as 1 record per block it covers
+        long pos = (long)sc->dirty_inodes[i] * sizeof(inode_t);
+        long end = pos + sizeof(inode_t);
+        while (pos < end){
+            int off = (int)(pos % BLOCK_SIZE);
+            int len = (int)(end - pos < BLOCK_SIZE - off ? end - pos : BLOCK_SIZE - off);
+            journal_write_bytes(inodetbl_loc + (int)(pos / BLOCK_SIZE), off, len, inode_tbl_mem + pos);
+            pos = pos + len;
+        }
+    }
+    sc->ndirty = 0;
+}
+
+//remember that the sfs_* call in progress in this thread modified inode_num
+void mark_inode_dirty(int inode_num){
+    scratch_t *sc = get_scratch();
+    for (int i = 0; i < sc->ndirty; i++){
+        if (sc->dirty_inodes[i] == inode_num){
+            return;
+        }
+    }
+    if (sc->ndirty == OP_MAX_INODES){
+        flush_inode_tbl();
+    }
+    sc->dirty_inodes[sc->ndirty] = inode_num;
+    sc->ndirty++;
+}
+
+//write back the metadata changed by an sfs_* call, called before it releases its locks
+//the call is then ended with journal_end_op() and committed along with the calls grouped with it
+void flush_metadata(){
+    flush_inode_tbl();
+    flush_fbm();
+}
+
+int flush_wbuf(int fd, int inode_num);
+void free_wbuf(int fd);
+void flush_write_buffers();
+void free_orphans();
+int map_extents(int fd, int64_t pointer, int length, sfs_extent_t *ext, int max_ext);
+int extent_blocks(const sfs_extent_t *ext, int *start);
+
+//write back the buffer cache and make the disk file durable when the program exits (there is no unmount call)
+void cache_exit(){
+    flush_write_buffers();
+    journal_close();
+    cache_close();
+    sync_disk();
+}
+
+//set up the buffer cache in front of the disk that was just opened
+void start_cache(){
+    cache_init(BLOCK_SIZE, CACHE_SIZE);
+    if (!cache_exit_set){
+        atexit(cache_exit);
+        cache_exit_set = 1;
+    }
+}
+
+
+//splits file block mem_blk_num into its level of indirection (0 for a direct pointer) and the index
+//used in the indirect block at each level, idx[0] being the index in the block that points to data
+//returns the level and sets *root to the inode field the lookup starts from, -1 if past the largest file
+int blk_path(inode_t *inode, int mem_blk_num, int **root, int idx[3]){
+    if (mem_blk_num < NUM_DIRECT){
+        *root = &inode->pointers[mem_blk_num];
+        return 0;
+    }
+    int *roots[3] = {&inode->ind_pointer, &inode->dind_pointer, &inode->tind_pointer};
+    int n = mem_blk_num - NUM_DIRECT;
+    int64_t span = PTRS_PER_BLK;    //file blocks reached through the root of this level
+    for (int level = 1; level <= 3; level++){
+        if (n < span){
+            *root = roots[level-1];
+            for (int l = 0; l < level; l++){
+                idx[l] = n % PTRS_PER_BLK;
+                n = n / PTRS_PER_BLK;
+            }
+            return level;
         }
+        n = n - span;
+        span = span * PTRS_PER_BLK;
     }
-    if (fbm_index == 0){ //if the index is still 0 there are no more available blocks
+    return -1;
+}
+
+//assigns a block for pointers and clears it, returns its disk_blk_num or -1 if the disk is full
+int new_ptr_block(){
+    int blk = find_free_block();
+    if (blk <= 0){
         return -1;
     }
-    write_blocks(fbm_loc, FBM_SIZE, fbm_map_mem);     //write fbm into memory
-    //convert from fbm index to data block index
-    disk_blk_num = fbm_index-data_loc;  //convert from fbm index to data block index(start at 0 with first data block) 
-    return disk_blk_num; //return disk block number of new datablock
+    journal_record(data_loc + blk, 0, JOURNAL_ZERO, NULL);
+    journal_write_block(data_loc + blk, zero_blk_mem); //may still hold data of a removed file
+    return blk;
+}
+
+//follows the indirect blocks from *root down to the one pointing to the data (the leaf) of a file block
+//with create, the missing blocks on the way are assigned, otherwise returns 0 when one is missing
+//returns the leaf disk_blk_num, 0 if missing or if the disk is full
+int find_leaf(int inode_num, int *root, int level, int idx[3], int create){
+    if (*root == 0){
+        int blk = create ? new_ptr_block() : -1;
+        if (blk <= 0){
+            return 0;
+        }
+        *root = blk;
+        mark_inode_dirty(inode_num);
+    }
+    int blk = *root;
+    char *indirect_ptrs_mem = get_scratch()->indirect_ptrs_mem;
+    indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem;
+    for (int l = level - 1; l >= 1; l--){ //down through the double and triple indirect blocks
+        if (!data_blk_valid(blk)){
+            return 0;
+        }
+        cache_read_blocks(data_loc + blk, 1, indirect_ptrs_mem);
+        int child = indirect_ptrs[idx[l]].ptr;
+        if (child == 0){
+            child = create ? new_ptr_block() : -1;
+            if (child <= 0){
+                return 0;
+            }
+            indirect_ptrs[idx[l]].ptr = child;
+            journal_record(data_loc + blk, idx[l] * sizeof(indirect_ptrs_t), sizeof(indirect_ptrs_t), &indirect_ptrs[idx[l]]);
+            journal_write_block(data_loc + blk, indirect_ptrs_mem);
+        }
+        blk = child;
+    }
+    return blk;
 }
 
+//converts block mem_blk_num of an inode that has no block map (the directory) into a disk block number
+//with create, an unassigned block is assigned, returns 0 if unassigned or if the disk is full
+int inode_bmap(int inode_num, int mem_blk_num, int create){
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    inode_t *inode = (inode_t *)&inode_table[inode_num];
+    int *root;
+    int idx[3];
+    int level = blk_path(inode, mem_blk_num, &root, idx);
+    if (level < 0){
+        return 0;
+    }
+    if (level == 0){
+        if (*root == 0 && create){
+            int blk = find_free_block();
+            *root = blk > 0 ? blk : 0;
+            mark_inode_dirty(inode_num);
+        }
+        return *root;
+    }
+    int leaf = find_leaf(inode_num, root, level, idx, create);
+    if (leaf <= 0){
+        return 0;
+    }
+    char *indirect_ptrs_mem = get_scratch()->indirect_ptrs_mem;
+    indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem;
+    cache_read_blocks(data_loc + leaf, 1, indirect_ptrs_mem);
+    if (indirect_ptrs[idx[0]].ptr == 0 && create){
+        int blk = find_free_block();
+        if (blk > 0){
+            indirect_ptrs[idx[0]].ptr = blk;
+            journal_record(data_loc + leaf, idx[0] * sizeof(indirect_ptrs_t), sizeof(indirect_ptrs_t), &indirect_ptrs[idx[0]]);
+            journal_write_block(data_loc + leaf, indirect_ptrs_mem);
+        }
+    }
+    return indirect_ptrs[idx[0]].ptr;
+}
 
 //write directory to memory selecting appropriate data block according to directory entry
 void write_dir_to_memory(int dir_entry_num){
     dir_entry_t *dir = (dir_entry_t *)dir_mem;
-    int mem_blk_num = (int)(floor((dir_entry_num) / (double) (BLOCK_SIZE/64))); //floor division pointer/block size => block number
-    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
-    inode_t *dir_inode = (inode_t *)&inode_table[0];      
-    int disk_blk_num = dir_inode->pointers[mem_blk_num];
-    if (disk_blk_num == 0){ //if it does not exist yet, assign it 
-        disk_blk_num = find_free_block(); //find a free block 
-        dir_inode->pointers[mem_blk_num] = disk_blk_num;   //write to inode  
-        write_blocks(inodetbl_loc,1,inode_tbl_mem);//write to memory
+    int dir_per_blk = BLOCK_SIZE / sizeof(dir_entry_t);    //directory entries per block
+    int mem_blk_num = dir_entry_num / dir_per_blk; //floor division pointer/block size => block number
+    int disk_blk_num = inode_bmap(directory_inode, mem_blk_num, 1); //assigned if it does not exist yet, directory inode written back by the caller
+    if (disk_blk_num <= 0){
+        printf("free block has not been found\n");
+        return;
+    }
+    journal_record(data_loc + disk_blk_num, (dir_entry_num % dir_per_blk) * sizeof(dir_entry_t), sizeof(dir_entry_t), &dir[dir_entry_num]);
+    journal_write_block(data_loc + disk_blk_num, dir+(mem_blk_num*dir_per_blk)); //write into disk each +1 is +64 bytes in dir_mem
+}
+
+//FNV-1a hash of a filename, returns its home slot in dir_hash
+int hash_filename(const char *fn){
+    unsigned int h = 2166136261u;
+    for (; *fn; fn++){
+        h = (h ^ (unsigned char)*fn) * 16777619u;
+    }
+    return (int)(h & (DIR_HASH_SIZE - 1));
+}
+
+//returns the dir_hash slot holding filename fn, -1 if the file does not exist
+int dir_hash_find(const char *fn){
+    dir_entry_t *dir = (dir_entry_t *)dir_mem;
+    int h = hash_filename(fn);
+    while (dir_hash[h].dir_entry_num >= 0){ //table is never full, so an empty slot ends the probe
+        if (strcmp(dir[dir_hash[h].dir_entry_num].filename, fn) == 0){
+            return h;
+        }
+        h = (h + 1) & (DIR_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
+//adds the (in use) directory entry to the hash table
+void dir_hash_insert(int dir_entry_num){
+    dir_entry_t *dir = (dir_entry_t *)dir_mem;
+    int h = hash_filename(dir[dir_entry_num].filename);
+    while (dir_hash[h].dir_entry_num >= 0){
+        h = (h + 1) & (DIR_HASH_SIZE - 1);
+    }
+    dir_hash[h].dir_entry_num = dir_entry_num;
+    dir_hash[h].inode = dir[dir_entry_num].inode;
+}
+
+//empties slot h, moving back later entries of the probe chain so lookups need no tombstones
+//(call before the directory entry itself is cleared, the entries moved are rehashed from dir_mem)
+void dir_hash_remove(int h){
+    dir_entry_t *dir = (dir_entry_t *)dir_mem;
+    int next = (h + 1) & (DIR_HASH_SIZE - 1);
+    while (dir_hash[next].dir_entry_num >= 0){
+        int home = hash_filename(dir[dir_hash[next].dir_entry_num].filename);
+        //move the entry into the hole unless its home slot lies cyclically in (h, next]
+        if (((next - home) & (DIR_HASH_SIZE - 1)) >= ((next - h) & (DIR_HASH_SIZE - 1))){
+            dir_hash[h] = dir_hash[next];
+            h = next;
+        }
+        next = (next + 1) & (DIR_HASH_SIZE - 1);
+    }
+    dir_hash[h].dir_entry_num = -1;
+    dir_hash[h].inode = 0;
+}
+
+//rebuilds the hash table from the directory in memory
+void dir_hash_build(){
+    dir_entry_t *dir = (dir_entry_t *)dir_mem;
+    for (int h = 0; h < DIR_HASH_SIZE; h++){
+        dir_hash[h].dir_entry_num = -1;
+        dir_hash[h].inode = 0;
+    }
+    for (int i = 0; i < MAX_FILE_NUM; i++){
+        if (dir[i].inode){
+            dir_hash_insert(i);
+        }
+    }
+}
+
+//marks entry i of an in-memory free map as unused (1) or taken (0)
+void free_map_set(fbm_word_t *map, int i, int available){
+    fbm_word_t bit = (fbm_word_t)1 << (i % FBM_WORD_BITS);
+    if (available){
+        map[i / FBM_WORD_BITS] |= bit;
+    }else{
+        map[i / FBM_WORD_BITS] &= ~bit;
+    }
+}
+
+//takes the lowest unused entry of a free map of n entries, a word (64 entries) at a time
+//returns its index, -1 if every entry is taken
+int free_map_take(fbm_word_t *map, int n){
+    for (int w = 0; w < FREE_MAP_WORDS(n); w++){
+        if (map[w]){
+            int i = w * FBM_WORD_BITS + __builtin_ctzll(map[w]);
+            free_map_set(map, i, 0);
+            return i;
+        }
+    }
+    return -1;
+}
+
+//rebuilds the free inode and free directory entry maps from the tables in memory
+void build_free_lists(){
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    dir_entry_t *dir = (dir_entry_t *)dir_mem;
+    memset(inode_free, 0, FREE_MAP_WORDS(TOTAL_INODE_ENTRIES) * sizeof(fbm_word_t));
+    for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){
+        if (((inode_t *)&inode_table[i])->link_cnt == 0){
+            free_map_set(inode_free, i, 1);
+        }
+    }
+    memset(dir_free, 0, FREE_MAP_WORDS(MAX_FILE_NUM) * sizeof(fbm_word_t));
+    for (int i = 0; i < MAX_FILE_NUM; i++){
+        if (dir[i].inode == 0){
+            free_map_set(dir_free, i, 1);
+        }
     }
-    write_blocks(data_loc + disk_blk_num,1,dir+(mem_blk_num*16)); //write into disk each +1 is +64 bytes in dir_mem
+}
+
+//empties the open file descriptor table (only in memory)
+void reset_ofdt(){
+    memset(ofdt_free, 0, FREE_MAP_WORDS(MAX_FILE_NUM) * sizeof(fbm_word_t));
+    for (int of = 0; of < MAX_FILE_NUM; of++){   //initialize with 0s 
+        ofdt[of].inode = 0;  
+        ofdt[of].offset = 0; 
+        free(ofdt[of].blk_map);
+        ofdt[of].blk_map = NULL;
+        ofdt[of].blk_map_len = 0;
+        free(ofdt[of].wbuf);
+        ofdt[of].wbuf = NULL;
+        ofdt[of].wbuf_len = 0;
+        ofdt[of].wbuf_resv = 0;
+        ofdt[of].ra_next = 0;
+        ofdt[of].ra_window = 0;
+        ofdt[of].ra_end = 0;
+        ofdt[of].map_off = -1;
+        ofdt[of].map_count = 0;
+        free_map_set(ofdt_free, of, 1);
+    }
+    for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){
+        inode_fd[i] = -1;
+    }
+    wbuf_reserved = 0;
+    wbuf_mem = 0;
 }
 
 //fct to check validity of fd
 int fd_valid(int fd){
     //check if entry is larger than the max number of entries or is negative
-    if (fd>MAX_FILE_NUM || fd<0){ 
+    if (fd>=MAX_FILE_NUM || fd<0){ 
         return -1; 
     }
     //check if entry is in use
+    pthread_mutex_lock(&dir_lock);
     int inode_num = ofdt[fd].inode;
+    pthread_mutex_unlock(&dir_lock);
     if (inode_num == 0){
         return -1; 
     }
     return 1;
 }
 
+//locks the inode open in fd (for writing with write) and returns its number, -1 if fd is not open
+//the entry is checked again once the inode is locked, it may have been closed in between
+int lock_fd(int fd, int write){
+    if (fd_valid(fd) < 0){
+        return -1;
+    }
+    pthread_mutex_lock(&dir_lock);
+    int inode_num = ofdt[fd].inode;
+    pthread_mutex_unlock(&dir_lock);
+    if (inode_num == 0){
+        return -1;
+    }
+    if (write){
+        pthread_rwlock_wrlock(&inode_locks[inode_num]);
+    }else{
+        pthread_rwlock_rdlock(&inode_locks[inode_num]);
+    }
+    pthread_mutex_lock(&dir_lock);
+    int same = ofdt[fd].inode == inode_num;
+    pthread_mutex_unlock(&dir_lock);
+    if (!same){
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        return -1;
+    }
+    return inode_num;
+}
+
 //returns minimum of 2 integers
 int min(int x, int y){
     if (x<y){
@@ -180,7 +833,7 @@ int min(int x, int y){
 
 //prints data blk
 void print_data_blk(){
-    data_t *data_blk = (data_t *)data_blk_mem;
+    data_t *data_blk = (data_t *)get_scratch()->data_blk_mem;
     for (int byte = 0; byte<BLOCK_SIZE; byte++){
         printf("--- DATA BLOCK --- \n");
         printf("%c",data_blk[byte].character);
@@ -204,9 +857,9 @@ void print_ofdt(){
             }
             
             printf("| inode : %d",ofdt[of].inode);
-            printf(" | offset : %d",ofdt[of].offset);
+            printf(" | offset : %lld",(long long)ofdt[of].offset);
             inode_t *cur_inode = (inode_t *)&inode_table[ofdt[of].inode];   
-            printf(" | filesize : %d \n",cur_inode->size);
+            printf(" | filesize : %lld \n",(long long)cur_inode->size);
 
 
         }
@@ -222,7 +875,6 @@ void print_inode(){
      //inode_tbl_mem
     printf("\nin memory inode table: \n");
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
-    inode_t *dir_inode = (inode_t *)&inode_table[0];             //second cast to inode table entry
 
 
     for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){ 
@@ -230,9 +882,9 @@ void print_inode(){
         if (inode->link_cnt){ //if used print values
             printf("----\nINODE: %d", i  );
             printf(" | mode: %d",inode->mode );
-            printf(" | size: %d\n",inode->size );
+            printf(" | size: %lld\n",(long long)inode->size );
             printf("\n Pointers: ");
-            for (int y = 0; y < 12; y++){ 
+            for (int y = 0; y < NUM_DIRECT; y++){ 
                 printf("%d, ",inode->pointers[y]);
             }
             printf("\n");
@@ -263,7 +915,6 @@ void print_values(){
     //inode_tbl_mem
     printf("\n----INODE TABLE--- \n");
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
-    inode_t *dir_inode = (inode_t *)&inode_table[0];             //second cast to inode table entry
 
 
     for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){ 
@@ -271,9 +922,9 @@ void print_values(){
         if (inode->link_cnt){ //if used print values
             printf("----\nINODE: %d", i  );
             printf(" | mode: %d",inode->mode );
-            printf(" | size: %d\n",inode->size );
+            printf(" | size: %lld\n",(long long)inode->size );
             printf("\n Pointers: ");
-            for (int y = 0; y < 12; y++){ 
+            for (int y = 0; y < NUM_DIRECT; y++){ 
                 printf("%d, ",inode->pointers[y]);
             }
             printf("\n");
@@ -292,112 +943,279 @@ void print_values(){
 
     //fbm map
     printf("\n ---FBM MAP--- \n");
-    fbm_map_t *fbm_map = (fbm_map_t *)fbm_map_mem;
     for (int i = 0; i < FILE_SYST_SIZE; i++){ 
-        printf("%d",fbm_map[i].available);
+        printf("%d",fbm_is_free(i));
     }
 
     //ofdt
     printf("\n----OFDT---- \n");
     for (int of = 0; of < MAX_FILE_NUM; of++){   //initialize with 0s 
         printf("inode : %d, ",ofdt[of].inode);
-        printf("offset : %d\n",ofdt[of].offset);
+        printf("offset : %lld\n",(long long)ofdt[of].offset);
     }
 
     printf("----- END PRINT -----\n");
 }
 
 
-//create file system on disk
-void mksfs(int f){ 
+//sets the geometry globals and (re)allocates the in-memory tables for it, returns -1 if out of memory
+int alloc_tables(int block_size, int num_blocks, int inodetbl_size, int fbm_size){
+    if (ofdt != NULL){  //block maps and locks of the previous mount
+        for (int of = 0; of < MAX_FILE_NUM; of++){
+            free(ofdt[of].blk_map);
+            free(ofdt[of].wbuf);
+            pthread_mutex_destroy(&ofdt[of].lock);
+            pthread_mutex_destroy(&ofdt[of].map_lock);
+        }
+    }
+    if (inode_locks != NULL){
+        for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){
+            pthread_rwlock_destroy(&inode_locks[i]);
+        }
+    }
+    BLOCK_SIZE = block_size;
+    FILE_SYST_SIZE = num_blocks;
+    INODE_TBL_SIZE = inodetbl_size;
+    FBM_SIZE = fbm_size;
+    TOTAL_INODE_ENTRIES = INODE_TBL_SIZE * (BLOCK_SIZE / sizeof(inode_t));
+    MAX_FILE_NUM = TOTAL_INODE_ENTRIES - 1;
+    DIR_SIZE = (MAX_FILE_NUM * sizeof(dir_entry_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    DIR_HASH_SIZE = 1;
+    while (DIR_HASH_SIZE < 2 * MAX_FILE_NUM){ //keep probe chains short
+        DIR_HASH_SIZE = DIR_HASH_SIZE * 2;
+    }
+    PTRS_PER_BLK = BLOCK_SIZE / sizeof(indirect_ptrs_t);
+    int64_t max_blks = NUM_DIRECT + (int64_t)PTRS_PER_BLK * (1 + PTRS_PER_BLK + (int64_t)PTRS_PER_BLK * PTRS_PER_BLK);
+    MAX_FILE_BLKS = max_blks > INT_MAX ? INT_MAX : (int)max_blks;   //file block numbers are ints
+
+    free(superblock_mem);
+    free(inode_tbl_mem);
+    free(dir_mem);
+    free(fbm_map_mem);
+    free(zero_blk_mem);
+    free(ofdt);
+    free(fbm_dirty);
+    free(fbm_word_dirty);
+    free(fbm_pending);
+    free(dir_hash);
+    free(inode_free);
+    free(ofdt_free);
+    free(dir_free);
+    free(inode_fd);
+    free(inode_locks);
+    superblock_mem = (char *)calloc(1, BLOCK_SIZE);
+    inode_tbl_mem = (char *)calloc(INODE_TBL_SIZE, BLOCK_SIZE);
+    dir_mem = (char *)calloc(DIR_SIZE, BLOCK_SIZE);
+    fbm_map_mem = (char *)calloc(FBM_SIZE, BLOCK_SIZE);
+    zero_blk_mem = (char *)calloc(1, BLOCK_SIZE);
+    ofdt = (ofdt_t *)calloc(MAX_FILE_NUM, sizeof(ofdt_t));
+    fbm_dirty = (char *)calloc(FBM_SIZE, 1);
+    fbm_word_dirty = (fbm_word_t *)calloc(FREE_MAP_WORDS((long)FBM_SIZE * FBM_WORDS_PER_BLK), sizeof(fbm_word_t));
+    fbm_pending = (fbm_word_t *)calloc(FREE_MAP_WORDS(FILE_SYST_SIZE), sizeof(fbm_word_t));
+    dir_hash = (dir_hash_t *)calloc(DIR_HASH_SIZE, sizeof(dir_hash_t));
+    inode_free = (fbm_word_t *)calloc(FREE_MAP_WORDS(TOTAL_INODE_ENTRIES), sizeof(fbm_word_t));
+    ofdt_free = (fbm_word_t *)calloc(FREE_MAP_WORDS(MAX_FILE_NUM), sizeof(fbm_word_t));
+    dir_free = (fbm_word_t *)calloc(FREE_MAP_WORDS(MAX_FILE_NUM), sizeof(fbm_word_t));
+    inode_fd = (int *)calloc(TOTAL_INODE_ENTRIES, sizeof(int));
+    inode_locks = (pthread_rwlock_t *)calloc(TOTAL_INODE_ENTRIES, sizeof(pthread_rwlock_t));
+    if (superblock_mem == NULL || inode_tbl_mem == NULL || dir_mem == NULL || fbm_map_mem == NULL
+        || zero_blk_mem == NULL || ofdt == NULL || fbm_dirty == NULL || fbm_word_dirty == NULL
+        || fbm_pending == NULL || dir_hash == NULL || inode_free == NULL
+        || ofdt_free == NULL || dir_free == NULL || inode_fd == NULL || inode_locks == NULL){
+        printf("Could not allocate file system tables\n");
+        return -1;
+    }
+    for (int of = 0; of < MAX_FILE_NUM; of++){
+        pthread_mutex_init(&ofdt[of].lock, NULL);
+        pthread_mutex_init(&ofdt[of].map_lock, NULL);
+    }
+    for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+    return 0;
+}
+
+//create file system on disk with the given geometry : block size in bytes (power of 2), disk size in blocks
+//and number of inodes (one of them is the directory's), returns -1 if the geometry is not usable
+int sfs_mkfs(int block_size, int num_blocks, int num_inodes){
     char filename[64 - sizeof(int)] = "sfs"; //declare & initialize filename
 
-    if (f){  //flag is true(1), create new file system
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0){
+        printf("Block size must be a power of 2 between %d and %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    int inodes_per_blk = block_size / sizeof(inode_t);
+    int inodetbl_size = (num_inodes + inodes_per_blk - 1) / inodes_per_blk;
+    int fbm_size = (num_blocks + block_size * 8 - 1) / (block_size * 8);
+    int journal_size = num_blocks / 64;
+    journal_size = journal_size < MIN_JOURNAL_SIZE ? MIN_JOURNAL_SIZE : min(journal_size, MAX_JOURNAL_SIZE);
+    if (num_inodes < 2 || num_blocks < 1 + inodetbl_size + journal_size + 1 + fbm_size + 1){ //superblock, inode table, journal, first directory blk, fbm and 1 data blk
+        printf("Disk of %d blocks is too small for %d inodes\n", num_blocks, num_inodes);
+        return -1;
+    }
+    flush_write_buffers();
+    journal_close(); //commit what is pending on a previously opened disk
+    cache_close(); //write back anything cached for a previously opened disk, before its block size changes
+    close_disk();
+    if (alloc_tables(block_size, num_blocks, inodetbl_size, fbm_size) < 0){
+        return -1;
+    }
    
-        //initialize global variables
-        fbm_loc = FILE_SYST_SIZE-FBM_SIZE;
-        inodetbl_loc = 1; //after super block
-        directory_inode = 0; //first inode should represent directory
-        data_loc = inodetbl_loc + INODE_TBL_SIZE;
-        current_file = 0;
+    //initialize global variables
+    JOURNAL_SIZE = journal_size;
+    fbm_loc = FILE_SYST_SIZE-FBM_SIZE;
+    inodetbl_loc = 1; //after super block
+    directory_inode = 0; //first inode should represent directory
+    journal_loc = inodetbl_loc + INODE_TBL_SIZE;
+    data_loc = journal_loc + JOURNAL_SIZE;
+    current_file = 0;
+
+    if (init_fresh_disk(filename, BLOCK_SIZE, FILE_SYST_SIZE) < 0){//provide array of disk blocks 
+        return -1;
+    }
+    start_cache();
 
-        init_fresh_disk(filename, BLOCK_SIZE, FILE_SYST_SIZE);//provide array of disk blocks 
+    // create new super block and write to disk
+    superblock_t *sb = (superblock_t *)superblock_mem;   //cast to superblock
+    (*sb).magic = SFS_MAGIC; //magic number reference in document
+    (*sb).block_size = BLOCK_SIZE;
+    (*sb).file_syst_size = FILE_SYST_SIZE;
+    (*sb).inodetbl_size = INODE_TBL_SIZE;
+    (*sb).fbm_size = FBM_SIZE;
 
-        // create new super block and write to disk
-        superblock_t *sb = (superblock_t *)superblock_mem;   //cast to superblock
-        (*sb).magic = 28980674; //magic number reference in document
-        (*sb).block_size = BLOCK_SIZE;
-        (*sb).file_syst_size = FILE_SYST_SIZE;
-        (*sb).inodetbl_size = INODE_TBL_SIZE;
-        (*sb).fbm_size = FBM_SIZE;
+    (*sb).inodetbl_loc = inodetbl_loc; //loc = block index
+    (*sb).fbm_loc = fbm_loc;
+    (*sb).root_inode_num = directory_inode;   //should be first index in inode table -> contiguous   
+    (*sb).journal_loc = journal_loc;
+    (*sb).journal_size = JOURNAL_SIZE;
 
-        (*sb).inodetbl_loc = inodetbl_loc; //loc = block index
-        (*sb).fbm_loc = fbm_loc;
-        (*sb).root_inode_num = directory_inode;   //should be first index in inode table -> contiguous   
+    cache_write_blocks(0, 1, superblock_mem); //write super block to memory (starting address = block index)
+
+    //initialize i-node cache and write to disk  (with first inode set to directory ->first data blk)
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
+    inode_t *dir_inode = (inode_t *)&inode_table[0];             //second cast to inode table entry
+    dir_inode->link_cnt = 1; //to signify directory i-node is taken 
+    dir_inode->pointers[0] = 0;//set initial pointer to 0th index of the data blocks (where the first directory block will be by default)
 
-        write_blocks(0, 1, superblock_mem); //write super block to memory (starting address = block index)
+    for (int i = 1; i < TOTAL_INODE_ENTRIES; i++){ //set all other link_cnts to 0 to mark as unused
+        inode_t *inode = (inode_t*)&inode_table[i];
+        inode->link_cnt = 0;
+    }
 
-        //initialize i-node cache and write to disk  (with first inode set to directory ->first data blk)
-        inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
-        inode_t *dir_inode = (inode_t *)&inode_table[0];             //second cast to inode table entry
-        dir_inode->link_cnt = 1; //to signify directory i-node is taken 
-        dir_inode->pointers[0] = 0;//set initial pointer to 0th index of the data blocks (where the first directory block will be by default)
+    cache_write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);     //write into memory
 
-        for (int i = 1; i < TOTAL_INODE_ENTRIES; i++){ //set all other link_cnts to 0 to mark as unused
-            inode_t *inode = (inode_t*)&inode_table[i];
-            inode->link_cnt = 0;
-        }
+    //initialize directory in memory
+    dir_entry_t *dir = (dir_entry_t *)dir_mem; 
+    for (int i = 0; i < MAX_FILE_NUM; i++){   //initialize with 0s 
+        memset(dir[i].filename, '\0', sizeof(dir[i].filename));
+        dir[i].inode = 0;
+    }
+    cache_write_blocks(data_loc, 1, dir_mem);  //assume this is the first block in mem
+    dir_hash_build();
 
-        write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);     //write into memory
 
-        //initialize directory in memory
-        dir_entry_t *dir = (dir_entry_t *)dir_mem; 
-        for (int i = 0; i < MAX_FILE_NUM; i++){   //initialize with 0s 
-            memset(dir[i].filename, '\0', sizeof(dir[i].filename));
-            dir[i].inode = 0;
-        }
-        write_blocks(1+INODE_TBL_SIZE, 1, dir_mem);  //assume this is the first block in mem
+    // free bitmap
+    memset(fbm_map_mem, 0, (long)FBM_SIZE * BLOCK_SIZE); //everything unavailable, including the superblock, inode table, journal, first directory blk and fbm
+    fbm_nfree = 0;
+    fbm_npending = 0;
+    int occupied_blks = data_loc + 1; //1 superblock + blks for inode table + journal + 1 blk for first directory data blk
+    for (int y = occupied_blks; y < fbm_loc; y++){  //fill up rest with 1s to mark as available
+        fbm_set(y, 1); 
+    }
+    cache_write_blocks(fbm_loc, FBM_SIZE, fbm_map_mem);     //write into memory
+    memset(fbm_dirty, 0, FBM_SIZE);
+    memset(fbm_word_dirty, 0, FREE_MAP_WORDS((long)FBM_SIZE * FBM_WORDS_PER_BLK) * sizeof(fbm_word_t));
+    fbm_cursor = 0;
+
+    //empty metadata journal, the layout above is written home directly (and made durable with the journal header)
+    cache_sync();
+    if (journal_init(BLOCK_SIZE, FILE_SYST_SIZE, journal_loc, JOURNAL_SIZE, CACHE_SIZE / 2, fbm_release_pending) < 0 || journal_format() < 0){
+        return -1;
+    }
+
+    build_free_lists();
 
+    //open-file descriptor table (only in memory)
+    reset_ofdt();
+    return 0;
+}
+
+//create file system on disk (default geometry) or mount the one already present
+void mksfs(int f){ 
+    char filename[64 - sizeof(int)] = "sfs"; //declare & initialize filename
+
+    if (f){  //flag is true(1), create new file system
+        sfs_mkfs(DEFAULT_BLOCK_SIZE, DEFAULT_FILE_SYST_SIZE, DEFAULT_INODE_NUM);
 
-        // free bitmap
-        fbm_map_t *fbm_map = (fbm_map_t *)fbm_map_mem; //typecast
-        int occupied_blks = 1 + INODE_TBL_SIZE + 1; //1 superblock + 10 blks for inode table + 1 blk for first directory data blk
-        for (int i = 0; i < occupied_blks; i++){    //mark as occupied for occupied blocks
-            (&fbm_map[i])->available = 0; 
+    }else{  //flag is false(0), valid file system already present(super block is valid)
+        flush_write_buffers();
+        journal_close(); //commit what is pending on a previously opened disk
+        cache_close(); //write back anything cached for a previously opened disk
+        close_disk();
+
+        //probe the superblock with the smallest block size, the geometry is not known yet
+        superblock_t sb;
+        if (init_disk(filename, MIN_BLOCK_SIZE, 1) < 0){
+            return;
         }
-        for (int y = occupied_blks; y < fbm_loc; y++){  //fill up rest with 1s to mark as available
-            (&fbm_map[y])->available = 1; 
+        char *probe = (char *)malloc(MIN_BLOCK_SIZE);
+        read_blocks(0, 1, probe);
+        memcpy(&sb, probe, sizeof(superblock_t));
+        free(probe);
+        close_disk();
+        if (sb.magic != SFS_MAGIC || sb.block_size < MIN_BLOCK_SIZE || sb.block_size > MAX_BLOCK_SIZE){
+            printf("No valid file system found in %s\n", filename);
+            return;
         }
-        for (int x = fbm_loc; x < FILE_SYST_SIZE; x++){  //last two blocks unavailable due to fbm
-            (&fbm_map[x])->available = 0;  //this syntax also seems to work
+        if (alloc_tables(sb.block_size, sb.file_syst_size, sb.inodetbl_size, sb.fbm_size) < 0){
+            return;
         }
-        write_blocks(fbm_loc, FBM_SIZE, fbm_map_mem);     //write into memory
 
-        //open-file descriptor table (only in memory)
-        for (int of = 0; of < MAX_FILE_NUM; of++){   //initialize with 0s 
-            ofdt[of].inode = 0;  
-            ofdt[of].offset = 0; 
+        if (init_disk(filename, BLOCK_SIZE, FILE_SYST_SIZE) < 0){
+            return;
         }
-
-    }else{  //flag is false(0), valid file system already present(super block is valid)
-        init_disk(filename, BLOCK_SIZE, FILE_SYST_SIZE);
+        start_cache();
         
         //retrieve disk data
-        read_blocks(0, 1, superblock_mem);
+        cache_read_blocks(0, 1, superblock_mem);
         fbm_loc = ((superblock_t *)superblock_mem)->fbm_loc;
         inodetbl_loc = ((superblock_t *)superblock_mem)->inodetbl_loc;
-        data_loc = inodetbl_loc + INODE_TBL_SIZE; //initialize location of data blocks after inode table
+        directory_inode = ((superblock_t *)superblock_mem)->root_inode_num;
+        journal_loc = ((superblock_t *)superblock_mem)->journal_loc;
+        JOURNAL_SIZE = ((superblock_t *)superblock_mem)->journal_size;
+        data_loc = journal_loc + JOURNAL_SIZE; //initialize location of data blocks after the journal
         current_file = 0;    //set current file to 0 for sfs_getnextfile
 
+        //bring the metadata home blocks up to date with what was committed before the last exit or crash
+        if (journal_init(BLOCK_SIZE, FILE_SYST_SIZE, journal_loc, JOURNAL_SIZE, CACHE_SIZE / 2, fbm_release_pending) < 0 || journal_replay() < 0){
+            return;
+        }
+
         //read in inode table and fbm
-        read_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem); 
-        read_blocks(fbm_loc, FBM_SIZE, fbm_map_mem);
+        cache_read_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem); 
+        cache_read_blocks(fbm_loc, FBM_SIZE, fbm_map_mem);
+        memset(fbm_dirty, 0, FBM_SIZE);
+        fbm_cursor = 0;
+        fbm_nfree = 0;
+        fbm_npending = 0;
+        for (int w = 0; w < (FILE_SYST_SIZE + FBM_WORD_BITS - 1) / FBM_WORD_BITS; w++){
+            fbm_nfree = fbm_nfree + __builtin_popcountll(((fbm_word_t *)fbm_map_mem)[w]);
+        }
+
+        //read in the directory blocks through the directory inode, then index the filenames
+        for (int b = 0; b < DIR_SIZE; b++){
+            int disk_blk_num = inode_bmap(directory_inode, b, 0);
+            if (disk_blk_num != 0){
+                cache_read_blocks(data_loc + disk_blk_num, 1, dir_mem + (long)b * BLOCK_SIZE);
+            }
+        }
+        dir_hash_build();
+        free_orphans();     //removes a crash cut short
         
+        build_free_lists();
+
         //open-file descriptor table (only in memory)
-        for (int of = 0; of < MAX_FILE_NUM; of++){   //initialize with 0s 
-            ofdt[of].inode = 0;  
-            ofdt[of].offset = 0; 
-        }
+        reset_ofdt();
     }
 }
 
@@ -409,15 +1227,33 @@ int sfs_fopen(char* fn){
     int fd; //file descriptor 
     int found = 0;
     int inode_num = 0;
-    dir_entry_t *dir = (dir_entry_t *)dir_mem; 
-    //search through directory for entry
-    for (int i = 0; i < MAX_FILE_NUM; i++){  
-        if (strcmp(dir[i].filename,fn) == 0){
-            found = 1; //set found to 1
-            inode_num = dir[i].inode;
-        }
+    if (journal_begin_op() < 0){ //journal aborted, read-only until mounted again
+        journal_end_op();
+        return -1;
+    }
+    pthread_mutex_lock(&dir_lock);
+    //look up the directory entry through the filename hash table
+    int h = dir_hash_find(fn);
+    if (h >= 0){
+        found = 1; //set found to 1
+        inode_num = dir_hash[h].inode;
     }
     if (found){     //case 1, opening old file
+        //if inode is already open, reuse its ofdt entry, otherwise create one
+        fd = inode_fd[inode_num];
+        if (fd < 0){
+            fd = free_map_take(ofdt_free, MAX_FILE_NUM); //first open ofdt
+            if (fd < 0){
+                pthread_mutex_unlock(&dir_lock);
+                journal_end_op();
+                return -1;
+            }
+            ofdt[fd].inode = inode_num; //set inode number
+            inode_fd[inode_num] = fd;
+        }
+        pthread_mutex_unlock(&dir_lock);   //open in fd, the file cannot be removed any more
+        pthread_rwlock_wrlock(&inode_locks[inode_num]);
+
         //get size from inode table
         inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
         inode_t *cur_inode = (inode_t *)&inode_table[inode_num];             
@@ -425,77 +1261,63 @@ int sfs_fopen(char* fn){
             printf("error link count for this file inode should be 1");
         }
         //get file size
-        int filesize = cur_inode->size; // get filesize 
+        int64_t filesize = cur_inode->size; // get filesize 
         cur_inode->mode = APPEND_MODE; //set mode to append, pointer-> at the end of the file
 
-        //write inode table back into disk 
-        write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);  
-
-        int found = 0; //if already present in table
-       
-        //check if inode is already present 
-        for (int i=0;i<MAX_FILE_NUM;i++ ){
-            if (ofdt[i].inode == inode_num){
-                ofdt[i].offset = filesize;
-                found = 1; 
-                fd = i;
-                break;
-            }
-        }
-        //if inode is not already present,create ofdt entry & set offset to filesize in ofdt
-        if (!found){
-            for (int i=0;i<MAX_FILE_NUM;i++ ){
-                if (ofdt[i].inode == 0){ //find first open ofdt
-                    fd = i; //ofdt entry
-                    ofdt[i].inode = inode_num; //set inode number
-                    ofdt[i].offset = filesize; //set filesize
-                    break; //break out of loop once inode has been found
-                }    
-            }             
-        }
+        //write inode table block back into disk 
+        mark_inode_dirty(inode_num);
+        flush_metadata();  
+        ofdt[fd].offset = filesize; //set offset to filesize
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        journal_end_op();
 
         return fd;
 
-    }else{ //case 2, new file
-        //go to inode table find free entry, update link count, set size to 0
-        inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
-        for (int i = 0; i < TOTAL_INODE_ENTRIES; i++){ //find first inode entry that is not used
-            inode_t *inode = (inode_t*)&inode_table[i];
-            if(inode->link_cnt == 0){
-                inode_num = i; //save inode index for directory
-                inode->link_cnt = 1; //update link count
-                inode->size = 0; //set size to 0
-                break; //stop here
+    }else{ //case 2, new file (nobody can reach its inode before it is in the directory, the directory lock covers it)
+        //take the first free ofdt, inode and directory entries, giving back what was taken if one is missing
+        fd = free_map_take(ofdt_free, MAX_FILE_NUM);
+        inode_num = free_map_take(inode_free, TOTAL_INODE_ENTRIES); //save inode index for directory
+        int dir_entry_num = free_map_take(dir_free, MAX_FILE_NUM);
+        if (fd < 0 || inode_num < 0 || dir_entry_num < 0){
+            if (fd >= 0){
+                free_map_set(ofdt_free, fd, 1);
             }
-        }   
-        //write inode table to disk
-        write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   
-
-        int dir_entry_num = 0;
-
-        //find directory entry that is free. put filename. and inode number
-        dir_entry_t *dir = (dir_entry_t *)dir_mem; 
-        for (int i = 0; i < MAX_FILE_NUM; i++){  //find first empty entry
-            if (dir[i].inode == 0){
-                dir[i].inode = inode_num;
-                strcpy(dir[i].filename,fn); //assign given filename
-                dir_entry_num = i;
-                break; 
+            if (inode_num >= 0){
+                free_map_set(inode_free, inode_num, 1);
+            }
+            if (dir_entry_num >= 0){
+                free_map_set(dir_free, dir_entry_num, 1);
             }
+            pthread_mutex_unlock(&dir_lock);
+            journal_end_op();
+            return -1;
         }
+        //update link count, set size to 0
+        inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
+        inode_t *inode = (inode_t*)&inode_table[inode_num];
+        memset(inode, 0, sizeof(inode_t)); //no stale pointers from a removed file
+        inode->link_cnt = 1; //update link count
+        inode->size = 0; //set size to 0
+        //mark inode table block as modified
+        mark_inode_dirty(inode_num);   
+
+        //put filename and inode number in the directory entry
+        dir_entry_t *dir = (dir_entry_t *)dir_mem; 
+        dir[dir_entry_num].inode = inode_num;
+        strcpy(dir[dir_entry_num].filename,fn); //assign given filename
+
+        dir_hash_insert(dir_entry_num);
 
         //find disk location of current dir_entry to rewrite into disk
         write_dir_to_memory(dir_entry_num);
+        flush_metadata();
 
         //update ofdt entry with inode and offset with the filesize (0)
-        for (int i=0;i<MAX_FILE_NUM;i++ ){
-            if (ofdt[i].inode == 0){ //find first open ofdt
-                fd = i; //ofdt entry
-                ofdt[i].inode = inode_num; //set inode number
-                ofdt[i].offset = 0; //set filesize
-                break; //break out of loop once inode has been found
-            }    
-        }
+        ofdt[fd].inode = inode_num; //set inode number
+        ofdt[fd].offset = 0; //set filesize
+        inode_fd[inode_num] = fd;
+        pthread_mutex_unlock(&dir_lock);
+        journal_end_op();
         //return index of this entry
         return fd;
     }
@@ -507,20 +1329,41 @@ int sfs_fopen(char* fn){
 int sfs_fclose(int fd){
     //check if fd entry is valid 
     if (LOG){printf("-> closing fd : %d \n", fd);}
-    if (fd_valid(fd) < 0){
+    if (journal_begin_op() < 0){ //journal aborted, read-only until mounted again
+        journal_end_op();
         return -1;
     }
+    int inode_num = lock_fd(fd, 1);
+    if (inode_num < 0){
+        journal_end_op();
+        return -1;
+    }
+    flush_wbuf(fd, inode_num);
+    free_wbuf(fd);
 
-    int inode_num = ofdt[fd].inode;
-
+    pthread_mutex_lock(&dir_lock);
     ofdt[fd].inode = 0;    //reset
     ofdt[fd].offset = 0;   //reset
+    free(ofdt[fd].blk_map); //the block map is only kept while the file is open
+    ofdt[fd].blk_map = NULL;
+    ofdt[fd].blk_map_len = 0;
+    ofdt[fd].ra_next = 0;
+    ofdt[fd].ra_window = 0;
+    ofdt[fd].ra_end = 0;
+    ofdt[fd].map_off = -1;
+    ofdt[fd].map_count = 0;
+    free_map_set(ofdt_free, fd, 1);
+    inode_fd[inode_num] = -1;
+    pthread_mutex_unlock(&dir_lock);
     //set to unused mode in inode
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
     inode_t *cur_inode = (inode_t *)&inode_table[inode_num];
     cur_inode->mode = UNUSED_MODE;   //set to unused mode to indicate it is not in the ofdt
     //write to memory
-    write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   
+    mark_inode_dirty(inode_num);
+    flush_metadata();   
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    journal_end_op();
     return 0;
 }
 
@@ -529,14 +1372,25 @@ int sfs_fseek(int fd, int loc){
     if (LOG){printf("-> Seeking fd : %d, to loc : %d \n", fd, loc);}
     //loc in number of bytes from 0th index 
     //larger than file size 
-    if (fd_valid(fd) < 0 || loc < 0){ //check fd validity
+    if (loc < 0){
         return -1;
     }
+    if (journal_begin_op() < 0){ //journal aborted, read-only until mounted again
+        journal_end_op();
+        return -1;
+    }
+    int inode_num = lock_fd(fd, 1); //check fd validity
+    if (inode_num < 0){
+        journal_end_op();
+        return -1;
+    }
+    flush_wbuf(fd, inode_num);  //buffered data counts in the size
     //retrieve file size to make sure pointer value is not larger
-    int inode_num = ofdt[fd].inode;
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
     inode_t *cur_inode = (inode_t *)&inode_table[inode_num];   
     if(loc > (cur_inode->size)-1){ 
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        journal_end_op();
         return -1;
     }
     //change mode in inode
@@ -548,9 +1402,12 @@ int sfs_fseek(int fd, int loc){
         cur_inode->mode = SEEK_MODE;
     }
     //write inode back into memory 
-    write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   
+    mark_inode_dirty(inode_num);
+    flush_metadata();   
     //modify pointer
     ofdt[fd].offset = loc;
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    journal_end_op();
     return 0;
 }
 
@@ -558,240 +1415,913 @@ int sfs_fseek(int fd, int loc){
 
 
 
-int sfs_fwrite(int fd, const char *buf, int length){ 
-    if (fd_valid(fd)<0){    //check fd validity
-        printf("invalid fd\n");
+//grows the block map of an open file to cover len file blocks, the new entries are not looked up yet
+int map_grow(ofdt_t *of, int len){
+    if (len <= of->blk_map_len){
+        return 0;
+    }
+    if (len < 2 * of->blk_map_len){ //grow geometrically, files are usually written sequentially
+        len = min(2 * of->blk_map_len, MAX_FILE_BLKS);
+    }
+    int *blk_map = (int *)realloc(of->blk_map, sizeof(int) * len);
+    if (blk_map == NULL){
+        printf("Could not allocate block map\n");
+        return -1;
+    }
+    for (int i = of->blk_map_len; i < len; i++){
+        blk_map[i] = -1;
+    }
+    of->blk_map = blk_map;
+    of->blk_map_len = len;
+    return 0;
+}
+
+//makes sure file block mem_blk_num of fd has been looked up in its block map
+//direct pointers are copied from the inode, a leaf indirect block is read once and copied whole
+//returns -1 if the block is past the largest file
+int map_fill(int fd, int mem_blk_num){
+    if (mem_blk_num >= MAX_FILE_BLKS){
+        return -1;
+    }
+    ofdt_t *of = &ofdt[fd];
+    if (mem_blk_num < of->blk_map_len && of->blk_map[mem_blk_num] >= 0){
+        return 0;
+    }
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    inode_t *inode = (inode_t *)&inode_table[of->inode];
+    int *root;
+    int idx[3];
+    int level = blk_path(inode, mem_blk_num, &root, idx);
+    if (level == 0){
+        if (map_grow(of, mem_blk_num + 1) < 0){
+            return -1;
+        }
+        of->blk_map[mem_blk_num] = data_blk_valid(*root) ? *root : 0;
+        return 0;
+    }
+    int first = mem_blk_num - idx[0];   //first file block described by the same leaf
+    if (map_grow(of, first + PTRS_PER_BLK) < 0){
         return -1;
     }
-    int inode_num = ofdt[fd].inode; //retrieve inode number and pointer from ofdt
-    int pointer = ofdt[fd].offset;
+    int leaf = find_leaf(of->inode, root, level, idx, 0);
+    char *indirect_ptrs_mem = get_scratch()->indirect_ptrs_mem;
+    indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem;
+    if (leaf > 0){
+        cache_read_blocks(data_loc + leaf, 1, indirect_ptrs_mem);
+    }
+    for (int i = 0; i < PTRS_PER_BLK; i++){ //a pointer out of the data blocks (damaged disk) reads as unassigned
+        of->blk_map[first + i] = leaf > 0 && data_blk_valid(indirect_ptrs[i].ptr) ? indirect_ptrs[i].ptr : 0;
+    }
+    return 0;
+}
 
-    if(LOG){printf("\n\n-> Writing %d bytes from inode_num : %d, which  has offset : %d \n",length,inode_num,pointer);}  
+//converts a file block number into a disk block number through the block map of fd, returns 0 if unassigned
+int bmap(int fd, int mem_blk_num){
+    pthread_mutex_lock(&ofdt[fd].map_lock);
+    int disk_blk_num = map_fill(fd, mem_blk_num) < 0 ? 0 : ofdt[fd].blk_map[mem_blk_num];
+    pthread_mutex_unlock(&ofdt[fd].map_lock);
+    return disk_blk_num;
+}
+
+//writes the leaf indirect block the write is updating back from the block map
+void flush_leaf(write_ctx_t *ctx){
+    if (ctx->leaf_dirty){
+        char *indirect_ptrs_mem = get_scratch()->indirect_ptrs_mem;
+        indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem;
+        for (int i = 0; i < PTRS_PER_BLK; i++){ //the whole leaf is in the map once any of it was looked up
+            indirect_ptrs[i].ptr = ofdt[ctx->fd].blk_map[ctx->leaf_first + i];
+        }
+        journal_record(data_loc + ctx->leaf_blk, ctx->leaf_lo * sizeof(indirect_ptrs_t),
+            (ctx->leaf_hi - ctx->leaf_lo + 1) * sizeof(indirect_ptrs_t), &indirect_ptrs[ctx->leaf_lo]);
+        journal_write_block(data_loc + ctx->leaf_blk, indirect_ptrs_mem);
+        ctx->leaf_dirty = 0;
+    }
+}
+
+//same as bmap but assigns a block from the write's extent when the file block is unassigned
+//(blks_left = blocks the write still spans), sets *new_blk to 1 in that case
+//returns -1 if the file cannot grow any further or the disk is full
+int bmap_alloc(write_ctx_t *ctx, int mem_blk_num, int blks_left, int *new_blk){
+    *new_blk = 0;
+    if (map_fill(ctx->fd, mem_blk_num) < 0){ //no pointer left to address this block
+        return -1;
+    }
+    int *blk_map = ofdt[ctx->fd].blk_map;
+    if (blk_map[mem_blk_num] > 0){
+        return blk_map[mem_blk_num];
+    }
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    inode_t *inode = (inode_t *)&inode_table[ctx->inode_num];
+    int *root;
+    int idx[3];
+    int level = blk_path(inode, mem_blk_num, &root, idx);
+    if (level > 0 && ctx->leaf_first != mem_blk_num - idx[0]){ //moving on to another leaf, create it if needed
+        flush_leaf(ctx);
+        int leaf = find_leaf(ctx->inode_num, root, level, idx, 1);
+        if (leaf <= 0){
+            return -1;
+        }
+        ctx->leaf_first = mem_blk_num - idx[0];
+        ctx->leaf_blk = leaf;
+    }
+    int disk_blk_num = next_extent_block(&ctx->ext_next, &ctx->ext_left, min(blks_left, PTRS_PER_BLK));  //1 leaf at a time, see write_at
+    if (disk_blk_num <= 0){
+        if(LOG){printf("-> free block has not been found \n");}
+        return -1;
+    }
+    blk_map[mem_blk_num] = disk_blk_num;
+    if (level == 0){
+        *root = disk_blk_num;                //update inode pointer
+        mark_inode_dirty(ctx->inode_num);
+    }else{
+        if (!ctx->leaf_dirty){
+            ctx->leaf_lo = idx[0];
+            ctx->leaf_hi = idx[0];
+        }
+        ctx->leaf_lo = min(ctx->leaf_lo, idx[0]);
+        ctx->leaf_hi = idx[0] > ctx->leaf_hi ? idx[0] : ctx->leaf_hi;
+        ctx->leaf_dirty = 1;
+    }
+    *new_blk = 1;
+    return disk_blk_num;
+}
+
+//writes length bytes of buf into the file open in fd from *pos, which is moved past them
+//with buf NULL the blocks are only assigned (a new one cleared), the caller writes the data to the disk file
+//with split, a long write stops once the journal transaction is full and sets *split, the caller goes on
+//in a new sfs_* call (blocks are assigned and written at most a leaf at a time, so a call stays near its share)
+//the caller holds the inode write lock, returns the number of bytes written
+int write_at(int fd, int inode_num, const char *buf, int length, int64_t *pos, int *split){
+    int64_t pointer = *pos;
+    char *data_blk_mem = get_scratch()->data_blk_mem;
+
+    if(LOG){printf("\n\n-> Writing %d bytes from inode_num : %d, which  has offset : %lld \n",length,inode_num,(long long)pointer);}  
 
-    read_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   //read inode table 
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
     inode_t *cur_inode = (inode_t *)&inode_table[inode_num];   
     
     //initialize variables
+    write_ctx_t ctx = {fd, inode_num, 0, 0, -1, 0, 0, 0, 0};
     int disk_blk_num = 0; //block number on disk 
     int buf_offset = 0;   //offset within buffer (data written overall)
-    int mem_blk_num = (int)(floor((pointer+1) / (double) BLOCK_SIZE)); //block number in memory 
-    int blk_ptr = pointer - ((mem_blk_num)*BLOCK_SIZE);     //pointer within block
+    int mem_blk_num = (int)(pointer / BLOCK_SIZE); //block number in memory 
+    int blk_ptr = (int)(pointer % BLOCK_SIZE);     //pointer within block
     int data_left = length; //data left to write  (length - buf_offset)
-    int data_written = 0;     //data written in current iteration (full block, or full block - blk_ptr or full block - blk_ptr)
-
-    while (1){// keep looping until there is no data left to write
-        if(LOG){printf("\n-> STARTING WRITE LOOP, inode_num = %d, mem_blk_num = %d, buf_offset = %d, data_left = %d, pointer = %d, blk_ptr = %d\n",inode_num,mem_blk_num,buf_offset,data_left, pointer, blk_ptr);}    
-        if (mem_blk_num == 12){ //implement indirect pointer data block;
-
-            //get disk block number, if unassigned create new 
-            read_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);
-            int ind_blk_num = cur_inode->pointers[12];
-
-            if (ind_blk_num > 0){ //if ind_blk_num already exists, retrieve indirect pointer
-                //retrieve block from disk, to get access to indirect pointers
-                read_blocks(data_loc + ind_blk_num, 1, indirect_ptrs_mem);
-                indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem; //type cast
-                disk_blk_num = indirect_ptrs[0].ptr; //assign value and exit 
-
-                if (disk_blk_num == 0){ //if not assigned yet, assign
-                    disk_blk_num = find_free_block(); 
-                    indirect_ptrs[0].ptr = disk_blk_num; //assign 
-                    write_blocks(data_loc + ind_blk_num, 1, indirect_ptrs);      //write back into memory
-                }
-
-            }else{ //if ind_blk_num does not exist, create it and create new indirect pointer
-                ind_blk_num = find_free_block(); 
-                cur_inode->pointers[12] = ind_blk_num;
-                write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem); //write inode to mem
+    int new_blk = 0;          //1 if the block was assigned by this call, its old contents are irrelevant
+    int next_new = 0;         //new_blk of the block that ended the last run, it was assigned then
+    cache_io_t *batch = NULL; //long runs, written together at the end with several requests in flight
+    int nbatch = 0;
+
+    while (data_left > 0){// keep looping until there is no data left to write
+        if(LOG){printf("\n-> STARTING WRITE LOOP, inode_num = %d, mem_blk_num = %d, buf_offset = %d, data_left = %d, pointer = %lld, blk_ptr = %d\n",inode_num,mem_blk_num,buf_offset,data_left, (long long)pointer, blk_ptr);}    
+        //blocks this write still spans, new blocks are reserved contiguously for all of them at once
+        int blks_left = (blk_ptr + data_left + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        disk_blk_num = bmap_alloc(&ctx, mem_blk_num, blks_left, &new_blk);
+        new_blk = new_blk || next_new;
+        next_new = 0;
+        if (disk_blk_num < 0){ // check for space in memory
+            if(LOG){printf("-> No more space in memory %lld, buf_offset : %d \n", (long long)pointer,buf_offset);}
+            break;
+        }
 
-                read_blocks(data_loc + ind_blk_num, 1, indirect_ptrs_mem); //read block (should be null since unused)
-                indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem; //type cast
-                disk_blk_num = find_free_block();   //find a block for the first pointer
-                indirect_ptrs[0].ptr = disk_blk_num;    //assign to indirect ptrs
-                write_blocks(data_loc + ind_blk_num, 1, indirect_ptrs);      //write back into disk  
+        int data_written;   //data written in this iteration
+        if (blk_ptr != 0 || data_left < BLOCK_SIZE){ //unaligned head or tail, goes through the data block buffer
+            data_written = min(BLOCK_SIZE - blk_ptr, data_left);
+            if (new_blk){   //nothing worth reading in a block that was just assigned
+                memset(data_blk_mem, 0, BLOCK_SIZE);
+            }else if (buf != NULL){
+                cache_read_blocks(data_loc + disk_blk_num, 1, data_blk_mem);   //read data block from disk
             }
-
-        }else if(mem_blk_num > 12){ //add to indirect pointers
-
-            read_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);
-            int ind_blk_num = cur_inode->pointers[12]; //get indirect block number
-
-            read_blocks(data_loc + ind_blk_num, 1, indirect_ptrs_mem); //read from disk
-            indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem; //type cast
-            disk_blk_num = indirect_ptrs[mem_blk_num-12].ptr; //retrieve value and continue program 
-            if (disk_blk_num == 0) { //if non existent, create new, assign disk_blk_num and write back into disk
-                disk_blk_num = find_free_block();
-                indirect_ptrs[mem_blk_num-12].ptr = disk_blk_num;
-                write_blocks(data_loc + ind_blk_num, 1, indirect_ptrs_mem); //read from disk
-            }      
-        }else{ //direct pointers    
-            read_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);       //convert memory block number from inode into disk block number
-            disk_blk_num = cur_inode->pointers[mem_blk_num];
-          
-            if (disk_blk_num == 0){               //if block is unassigned, assign a new one looking at free bit map(fbm)
-                disk_blk_num = find_free_block();
-
-                if (disk_blk_num <= 0){                                              //if a free block has not been found return -1
-                    if(LOG){printf("-> free block has not been found \n");}
-                    ofdt[fd].offset = pointer;                                      //update pointer in ofdt table
-                    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;  //update pointer/file size in inode 
-                    inode_t *cur_inode = (inode_t *)&inode_table[inode_num];   
-                    cur_inode->size = pointer;
-                    //write inode into memory
-                    write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   
-                    printf("free block has not been found\n");
-                    return buf_offset;                                        //return data written until now
+            if (buf != NULL){
+                data_t *data_blk = (data_t *)data_blk_mem;               //convert into byte addressable data type
+                memcpy(data_blk + blk_ptr, buf+buf_offset, data_written);
+            }
+            if (new_blk || buf != NULL){
+                cache_write_blocks(data_loc + disk_blk_num, 1, data_blk_mem);     //save data block to memory 
+            }
+            if (LOG){printf("partial block written : %d bytes \n ",data_written);}
+        }else{  //whole blocks, extend the run while they are contiguous on disk and write it in one call
+            int full_blks = min(data_left / BLOCK_SIZE, PTRS_PER_BLK);
+            int run = 1;
+            while (run < full_blks){
+                int next = bmap_alloc(&ctx, mem_blk_num + run, blks_left - run, &next_new);
+                if (next != disk_blk_num + run){    //not contiguous (or no space), next iteration starts from it
+                    break;
                 }
-                cur_inode->pointers[mem_blk_num] = disk_blk_num;                //update inode pointer
-                write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);     //write into memory
+                next_new = 0;
+                run++;
+            }
+            data_written = run * BLOCK_SIZE;
+            if (buf != NULL && run >= WRITE_AROUND_BLKS && batch == NULL){ //without it the runs go through the cache
+                batch = (cache_io_t *)malloc(sizeof(cache_io_t) * (data_left / (WRITE_AROUND_BLKS * BLOCK_SIZE) + 1));
+            }
+            if (buf == NULL){   //only assigning, the whole blocks are written by the caller
+            }else if (run >= WRITE_AROUND_BLKS && batch != NULL){ //too long to be worth caching
+                batch[nbatch].start_address = data_loc + disk_blk_num;
+                batch[nbatch].nblocks = run;
+                batch[nbatch].buffer = (char *)(buf+buf_offset);
+                nbatch++;
+            }else{
+                cache_write_blocks(data_loc + disk_blk_num, run, (void *)(buf+buf_offset));
             }
+            if (LOG){printf("run of %d blocks written \n ",run);}
         }
-        if (disk_blk_num > FILE_SYST_SIZE - data_loc - FBM_SIZE ){ // check for space in memory
-            if(LOG){printf("-> No more space in memory %d, buf_offset : %d \n", pointer,buf_offset);}
-            //update pointer in ofdt table
-            ofdt[fd].offset = pointer;
-            //update pointer/file size in inode 
-            inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
-            inode_t *cur_inode = (inode_t *)&inode_table[inode_num];   
-            cur_inode->size = pointer;
-            //write inode into memory
-            write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   
-            return buf_offset;
-        }
-        read_blocks(data_loc + disk_blk_num, 1, data_blk_mem);   //read data block from disk
-        data_t *data_blk = (data_t *)data_blk_mem;               //convert into byte addressable data type
-        
-        //data written in this iteration
-        data_written = min(BLOCK_SIZE - blk_ptr, data_left);  //data that will be written to the block
-        
-        if (LOG){printf("data written this iteration : min(%d,%d) \n ",BLOCK_SIZE - blk_ptr,data_left);}
-        
-        // copy data
-        memcpy(data_blk + blk_ptr, buf+buf_offset, data_written);
-        write_blocks(data_loc + disk_blk_num, 1, data_blk_mem);     //save data block to memory 
 
         pointer = pointer + data_written;           //update pointer
         data_left = data_left - data_written;       //data left to write
         buf_offset = length - data_left;            //offset within buffer
         
-        if (data_left <= 0){  //check if data has been writteN
-            if(LOG){printf("-> HURRAY. no more data left to write, exiting loop,pointer : %d, buf_offset : %d \n", pointer,buf_offset);}
-            //update pointer in ofdt table
-            ofdt[fd].offset = pointer;
-            //update pointer/file size in inode 
-            inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
-            inode_t *cur_inode = (inode_t *)&inode_table[inode_num];   
-            cur_inode->size = pointer;
-            //write inode into memory
-            write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);   
-            return buf_offset;  //exit loop 
-        }
-        
         //update iteration variables 
-        mem_blk_num = mem_blk_num+1;                //increment memory block number 
-        data_written = 0;                           //initialize to zero for next block
+        mem_blk_num = (int)(pointer / BLOCK_SIZE);  //next memory block number 
         blk_ptr = 0;                                //starting in a new block, so pointer within block will be 0
 
+        if (split != NULL && data_left > 0){ //log what was assigned so far, it counts in the transaction
+            flush_leaf(&ctx);
+            flush_fbm();
+            if (journal_op_full()){
+                *split = 1;
+                break;
+            }
+        }
+    }
+    if (nbatch > 0){
+        cache_write_batch(batch, nbatch);
+    }
+    free(batch);
+    if (data_left > 0 && (split == NULL || !*split)){
+        printf("free block has not been found\n");
     }
+    if(LOG){printf("-> write done, pointer : %lld, buf_offset : %d \n", (long long)pointer,buf_offset);}
+
+    *pos = pointer;
+    //update file size in inode, overwriting the middle of the file does not shrink it
+    //(a mapping grows it once the caller has written the data, see sfs_unmap)
+    if (buf != NULL && pointer > cur_inode->size){
+        cur_inode->size = pointer;
+    }
+    flush_leaf(&ctx);
+    //write inode into memory
+    mark_inode_dirty(inode_num);
+    release_extent(ctx.ext_next, ctx.ext_left);
+    flush_metadata();   
+    return buf_offset;
 }
 
-int sfs_fread(int fd, char *buf, int length){
-    //check fd validity
-    if (fd_valid(fd)<0){
+//reserves n more available blocks for the write buffers (gives them back if n is negative), -1 if there are not enough
+int reserve_blocks(int n){
+    pthread_mutex_lock(&alloc_lock);
+    if (n > 0 && fbm_nfree - fbm_npending - wbuf_reserved < n){
+        pthread_mutex_unlock(&alloc_lock);
         return -1;
     }
-    //retrieve inode number and pointer from ofdt
-    int inode_num = ofdt[fd].inode;
-    int pointer = ofdt[fd].offset;
+    wbuf_reserved = wbuf_reserved + n;
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+//blocks to reserve for a write buffer ending at file offset end: the data blocks past the end of the file
+//and the indirect blocks that may have to be assigned to point to them
+int wbuf_need(inode_t *inode, int64_t end){
+    int64_t have = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t want = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (want <= have){
+        return 0;
+    }
+    int64_t n = want - have;
+    return (int)(n + n / PTRS_PER_BLK + 3);
+}
+
+//writes the buffered data of fd to the file, its blocks are assigned now that the whole run is known
+//the caller holds the inode write lock and is in a journal op, returns -1 if not everything could be written
+int flush_wbuf(int fd, int inode_num){
+    ofdt_t *of = &ofdt[fd];
+    if (of->wbuf_len == 0){
+        return 0;
+    }
+    scratch_t *scratch = get_scratch();
+    scratch->resv = of->wbuf_resv;  //the allocations of this flush may take the blocks kept for it
+    scratch->resv_taken = 0;
+    of->wbuf_resv = 0;
+    int64_t pos = of->wbuf_off;
+    int written = write_at(fd, inode_num, of->wbuf, of->wbuf_len, &pos, NULL);    //at most WRITE_BUFFER_BLKS, within the share of a call
+    reserve_blocks(-scratch->resv);
+    scratch->resv = 0;
+    scratch->resv_taken = 0;
+    int res = written == of->wbuf_len ? 0 : -1;
+    of->wbuf_len = 0;
+    return res;
+}
+
+//gathers a small write in the write buffer of fd, flushing what it held if the write does not follow it
+//returns the number of bytes buffered, -1 if the write has to go straight through (too large, no memory
+//for the buffer or no blocks left to reserve for it)
+int buffer_write(int fd, int inode_num, const char *buf, int length){
+    ofdt_t *of = &ofdt[fd];
+    int cap = WRITE_BUFFER_BLKS * BLOCK_SIZE;
+    if (length >= cap){
+        return -1;
+    }
+    if (of->wbuf_len > 0 && (of->offset != of->wbuf_off + of->wbuf_len || of->wbuf_len + length > cap)){
+        flush_wbuf(fd, inode_num);
+    }
+    if (of->wbuf == NULL){
+        pthread_mutex_lock(&alloc_lock);
+        int fits = wbuf_mem + cap <= (long)WRITE_BUFFER_TOTAL_BLKS * BLOCK_SIZE;
+        if (fits){
+            wbuf_mem = wbuf_mem + cap;
+        }
+        pthread_mutex_unlock(&alloc_lock);
+        if (!fits){ //memory pressure, write through
+            return -1;
+        }
+        of->wbuf = (char *)malloc(cap);
+        if (of->wbuf == NULL){
+            pthread_mutex_lock(&alloc_lock);
+            wbuf_mem = wbuf_mem - cap;
+            pthread_mutex_unlock(&alloc_lock);
+            return -1;
+        }
+    }
+    if (of->wbuf_len == 0){
+        of->wbuf_off = of->offset;
+    }
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    int need = wbuf_need((inode_t *)&inode_table[inode_num], of->wbuf_off + of->wbuf_len + length);
+    if (need > of->wbuf_resv){
+        if (reserve_blocks(need - of->wbuf_resv) < 0){  //nearly full, the caller writes through and finds out what fits
+            return -1;
+        }
+        of->wbuf_resv = need;
+    }
+    memcpy(of->wbuf + of->wbuf_len, buf, length);
+    of->wbuf_len = of->wbuf_len + length;
+    of->offset = of->offset + length;
+    return length;
+}
+
+//gives the write buffer of fd back once it was flushed, the caller holds the inode write lock
+void free_wbuf(int fd){
+    ofdt_t *of = &ofdt[fd];
+    if (of->wbuf == NULL){
+        return;
+    }
+    free(of->wbuf);
+    of->wbuf = NULL;
+    pthread_mutex_lock(&alloc_lock);
+    wbuf_mem = wbuf_mem - (long)WRITE_BUFFER_BLKS * BLOCK_SIZE;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+//takes the inode lock of fd shared with its write buffer flushed, returns the inode number or -1
+int lock_fd_flushed(int fd){
+    for (;;){
+        int inode_num = lock_fd(fd, 0);
+        if (inode_num < 0 || ofdt[fd].wbuf_len == 0){
+            return inode_num;
+        }
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        if (journal_begin_op() < 0){ //the buffered data cannot be written any more
+            journal_end_op();
+            return -1;
+        }
+        inode_num = lock_fd(fd, 1);
+        if (inode_num >= 0){
+            flush_wbuf(fd, inode_num);
+            pthread_rwlock_unlock(&inode_locks[inode_num]);
+        }
+        journal_end_op();
+        if (inode_num < 0){
+            return -1;
+        }
+    }
+}
 
-    if(LOG){printf("\n\n-> READING %d bytes from inode_num : %d, which  has offset : %d \n",length,inode_num,pointer);}  
+//flushes the write buffers of every open file
+void flush_write_buffers(){
+    if (ofdt == NULL){
+        return;
+    }
+    for (int fd = 0; fd < MAX_FILE_NUM; fd++){
+        int inode_num = lock_fd_flushed(fd);
+        if (inode_num >= 0){
+            pthread_rwlock_unlock(&inode_locks[inode_num]);
+        }
+    }
+}
+
+//writes length bytes of buf to the file open in fd from *pos, in as many sfs_* calls as the journal needs
+//between two, the inode lock is let go and the call ended, each is committed with the blocks it assigned
+//the caller began a call and holds the inode write lock, *inode_num is set to -1 if the file was closed
+//meanwhile (nothing is held then), returns the number of bytes written
+int write_ops(int fd, int *inode_num, const char *buf, int length, int64_t *pos){
+    int written = 0;
+    for (;;){
+        int split = 0;
+        written = written + write_at(fd, *inode_num, buf + written, length - written, pos, &split);
+        if (!split){
+            return written;
+        }
+        int inode = *inode_num;
+        pthread_rwlock_unlock(&inode_locks[inode]);
+        journal_end_op();
+        if (journal_begin_op() < 0){ //the caller ends this call
+            *inode_num = -1;
+            return written;
+        }
+        *inode_num = lock_fd(fd, 1);
+        if (*inode_num != inode){
+            if (*inode_num >= 0){
+                pthread_rwlock_unlock(&inode_locks[*inode_num]);
+            }
+            *inode_num = -1;
+            return written;
+        }
+    }
+}
+
+int sfs_fwrite(int fd, const char *buf, int length){ 
+    if (journal_begin_op() < 0){ //journal aborted, read-only until mounted again
+        journal_end_op();
+        return -1;
+    }
+    int inode_num = lock_fd(fd, 1); //check fd validity, retrieve inode number and pointer from ofdt
+    if (inode_num < 0){
+        printf("invalid fd\n");
+        journal_end_op();
+        return -1;
+    }
+    int written = buffer_write(fd, inode_num, buf, length);  //small writes only cost a copy
+    if (written < 0){
+        flush_wbuf(fd, inode_num);
+        int64_t pos = ofdt[fd].offset;  //the entry is let go between the calls of a long write
+        written = write_ops(fd, &inode_num, buf, length, &pos);
+        if (inode_num >= 0){
+            ofdt[fd].offset = pos;
+        }
+    }
+    if (inode_num >= 0){
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+    }
+    journal_end_op();
+    return written;
+}
+
+//writes at offset without moving the file pointer, offset may be at most the file size (no holes)
+int sfs_pwrite(int fd, const char *buf, int length, int64_t offset){
+    if (journal_begin_op() < 0){ //journal aborted, read-only until mounted again
+        journal_end_op();
+        return -1;
+    }
+    int inode_num = lock_fd(fd, 1);
+    if (inode_num < 0){
+        printf("invalid fd\n");
+        journal_end_op();
+        return -1;
+    }
+    flush_wbuf(fd, inode_num);  //buffered data may overlap, and counts in the size
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    inode_t *cur_inode = (inode_t *)&inode_table[inode_num];
+    int written = -1;
+    if (offset >= 0 && offset <= cur_inode->size){
+        written = write_ops(fd, &inode_num, buf, length, &offset);
+    }
+    if (inode_num >= 0){
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+    }
+    journal_end_op();
+    return written;
+}
+
+//detects sequential reads of fd and prefetches the blocks following the one being read into the cache
+//the window starts at READ_AHEAD_MIN blocks and doubles each time it is issued again, the next part is
+//issued once the reads get within half a window of its end so it arrives before it is needed
+void read_ahead(int fd, int64_t pointer, int size, int64_t file_size){
+    ofdt_t *of = &ofdt[fd];
+    int last = (int)((pointer + size - 1) / BLOCK_SIZE);    //last block of this read
+    int64_t file_blks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int from = 0;
+    int to = 0;
+
+    pthread_mutex_lock(&of->map_lock);
+    if (pointer != of->ra_next){    //random access, stop reading ahead
+        of->ra_window = 0;
+    }else if (of->ra_window == 0){  //reads became sequential
+        of->ra_window = READ_AHEAD_MIN;
+        of->ra_end = last + 1;
+    }
+    of->ra_next = pointer + size;
+    if (of->ra_window > 0 && last + 1 + of->ra_window / 2 >= of->ra_end){
+        from = of->ra_end > last + 1 ? of->ra_end : last + 1;
+        to = last + 1 + of->ra_window;
+        to = to < file_blks ? to : (int)file_blks;
+        if (from < to){
+            of->ra_end = to;
+            of->ra_window = min(2 * of->ra_window, READ_AHEAD_MAX);
+        }
+    }
+    pthread_mutex_unlock(&of->map_lock);
+
+    //prefetch the runs contiguous on disk
+    int run_start = 0;
+    int run_len = 0;
+    for (int b = from; b < to; b++){
+        int disk_blk_num = bmap(fd, b);
+        if (disk_blk_num == 0){
+            break;
+        }
+        if (run_len > 0 && disk_blk_num == run_start + run_len){
+            run_len++;
+            continue;
+        }
+        if (run_len > 0){
+            cache_prefetch(data_loc + run_start, run_len);
+        }
+        run_start = disk_blk_num;
+        run_len = 1;
+    }
+    if (run_len > 0){
+        cache_prefetch(data_loc + run_start, run_len);
+    }
+}
+
+//reads up to length bytes of the file open in fd from *pos into buf, *pos is moved past them
+//the caller holds the inode lock (shared is enough), returns the number of bytes read
+int read_at(int fd, int inode_num, char *buf, int length, int64_t *pos){
+    int64_t pointer = *pos;
+    char *data_blk_mem = get_scratch()->data_blk_mem;
+
+    if(LOG){printf("\n\n-> READING %d bytes from inode_num : %d, which  has offset : %lld \n",length,inode_num,(long long)pointer);}  
 
     // //retrieve inode 
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; //first cast to inode table
     inode_t *cur_inode = (inode_t *)&inode_table[inode_num];
-    int filesize = cur_inode->size;  
-    int size  = min(filesize-pointer,length); //size of data portion to write
+    int64_t data_avail = cur_inode->size - pointer;   //data between the pointer and the end of the file
+    int size  = data_avail < length ? (int)data_avail : length; //size of data portion to write
+    if (size <= 0){
+        return 0;
+    }
+    read_ahead(fd, pointer, size, cur_inode->size);
     //loop variables
     int data_left = size;//data left to read  
     int disk_blk_num = 0;
 
     int buf_offset = 0; //at the start of buffer
-    int mem_blk_num = (int)(floor((pointer+1) / (double) BLOCK_SIZE)); //floor division pointer/block size => block number
-    int blk_ptr = pointer - ((mem_blk_num)*BLOCK_SIZE);               //pointer within block
-
-    while(1){
-        if(LOG){printf("\n-> STARTING READ LOOP, inode_num = %d, mem_blk_num = %d, buf_offset = %d, data_left = %d, pointer = %d, blk_ptr = %d\n",inode_num,mem_blk_num,buf_offset,data_left, pointer, blk_ptr);}   
-        if (mem_blk_num < 12){ //direct pointers  
-
-            disk_blk_num = cur_inode->pointers[mem_blk_num];    //convert memory block number from inode into disk block number
-       
-        }else{ //indirect pointers
-            int ind_blk_num = cur_inode->pointers[12]; //get indirect block number
-            read_blocks(data_loc + ind_blk_num, 1, indirect_ptrs_mem); //read from disk
-            indirect_ptrs_t *indirect_ptrs = (indirect_ptrs_t *)indirect_ptrs_mem; //type cast
-            disk_blk_num = indirect_ptrs[mem_blk_num-12].ptr; //retrieve value and continue program 
-        }
+    int mem_blk_num = (int)(pointer / BLOCK_SIZE); //floor division pointer/block size => block number
+    int blk_ptr = (int)(pointer % BLOCK_SIZE);               //pointer within block
+    cache_io_t *batch = NULL; //runs of whole blocks, read together with several requests in flight
+    int nbatch = 0;
+    int res = 0;
+
+    while(data_left > 0){
+        if(LOG){printf("\n-> STARTING READ LOOP, inode_num = %d, mem_blk_num = %d, buf_offset = %d, data_left = %d, pointer = %lld, blk_ptr = %d\n",inode_num,mem_blk_num,buf_offset,data_left, (long long)pointer, blk_ptr);}   
+        disk_blk_num = bmap(fd, mem_blk_num);    //convert memory block number into disk block number through the block map
        
-        if (disk_blk_num == 0){  // check that disk block number is valid
-            //assume reading has reached the end of the file 
-            if (LOG){printf("-> No more blocks to read, pointer : %d, buf_offset: %d \n ",pointer,buf_offset);}
-            ofdt[fd].offset = pointer+1;  //update pointer in ofdt table
-            return buf_offset;  //exit loop 
+        if (disk_blk_num == 0){  //no block within the file size (damaged disk), the read stops short of it
+            if (LOG){printf("-> No more blocks to read, pointer : %lld, buf_offset: %d \n ",(long long)pointer,buf_offset);}
+            break;
         }
 
-        //read block from disk
-        read_blocks(data_loc + disk_blk_num, 1, data_blk_mem);
-        data_t *data_blk = (data_t *)data_blk_mem; //convert into byte addressable data type
-
-        //data read
-        int data_read = min(BLOCK_SIZE - blk_ptr, data_left);
-        if (LOG){printf("data read : min(%d,%d) \n ",BLOCK_SIZE - blk_ptr,data_left);}
+        int data_read;  //data read in this iteration
+        if (blk_ptr != 0 || data_left < BLOCK_SIZE){ //unaligned head or tail, goes through the data block buffer
+            data_read = min(BLOCK_SIZE - blk_ptr, data_left);
+            if (cache_read_blocks(data_loc + disk_blk_num, 1, data_blk_mem) < 0){
+                res = -1;
+                break;
+            }
+            data_t *data_blk = (data_t *)data_blk_mem; //convert into byte addressable data type
+            memcpy(buf+buf_offset, data_blk + blk_ptr, data_read);
+            if (LOG){printf("partial block read : %d bytes \n ",data_read);}
+        }else{  //whole blocks, read the run of blocks contiguous on disk straight into the buffer
+            int full_blks = data_left / BLOCK_SIZE;
+            int run = 1;
+            while (run < full_blks && bmap(fd, mem_blk_num + run) == disk_blk_num + run){
+                run++;
+            }
+            data_read = run * BLOCK_SIZE;
+            if (batch == NULL){
+                batch = (cache_io_t *)malloc(sizeof(cache_io_t) * (data_left / BLOCK_SIZE + 1));
+                if (batch == NULL){
+                    printf("Could not allocate read batch\n");
+                    return -1;
+                }
+            }
+            batch[nbatch].start_address = data_loc + disk_blk_num;
+            batch[nbatch].nblocks = run;
+            batch[nbatch].buffer = buf+buf_offset;
+            nbatch++;
+            if (LOG){printf("run of %d blocks read \n ",run);}
+        }
 
-        //copy data
-        memcpy(buf+buf_offset, data_blk + blk_ptr, data_read);
         pointer = pointer + data_read;   //update pointer value
         data_left = data_left - data_read;          //data left to read
         buf_offset = size - data_left;        //offset within buffer
-        //check if we are finished, if so break out of the loop
-        if (data_left <= 0){  
-            if (LOG){printf("->HURRAY. finished  reading, pointer : %d, buf_offset: %d \n ",pointer+1,buf_offset);}
-            ofdt[fd].offset = pointer;  //update pointer in ofdt table, +1 because length = sizeof(buffer)+1
-            return buf_offset;          //exit loop 
-        }   
 
         //updat looping variables
-        mem_blk_num = mem_blk_num+1;                //increment memory block number 
+        mem_blk_num = (int)(pointer / BLOCK_SIZE);  //next memory block number 
         blk_ptr = 0;                                //starting in a new block, so pointer within block will be 0
-        data_read = 0;                              //initialize to 0 for next block
-       
+    }
+    if (LOG){printf("->HURRAY. finished  reading, pointer : %lld, buf_offset: %d \n ",(long long)pointer,buf_offset);}
+    if (res == 0 && nbatch > 0 && cache_read_batch(batch, nbatch) < 0){
+        res = -1;
+    }
+    free(batch);
+    if (res < 0){   //the pointer does not move
+        return -1;
+    }
+    *pos = pointer;  //update pointer
+    return buf_offset;          //exit loop 
+}
+
+int sfs_fread(int fd, char *buf, int length){
+    //check fd validity, retrieve inode number and pointer from ofdt, the buffered writes reach the file first
+    int inode_num = lock_fd_flushed(fd);
+    if (inode_num < 0){
+        return -1;
+    }
+    pthread_mutex_lock(&ofdt[fd].lock);
+    int res = read_at(fd, inode_num, buf, length, &ofdt[fd].offset);
+    pthread_mutex_unlock(&ofdt[fd].lock);
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    return res;
+}
+
+//maps length bytes of the file open in fd from offset to runs of the disk file (get_disk_fd()) so the caller can
+//transfer them itself (splice), returns the number of runs filled in ext, at most max_ext, or -1
+//reading, the range stops at the end of the file and cached changes to it are written back first
+//writing, the blocks are assigned as sfs_pwrite would, the size is only grown by sfs_unmap() to what was written
+//the file stays locked (shared reading, exclusive writing) until the caller is done with the runs and calls
+//sfs_unmap(), which it must do for any result but -1 : nothing can change the blocks or read them meanwhile
+int sfs_map(int fd, int64_t offset, int length, int write, sfs_extent_t *ext, int max_ext){
+    if (offset < 0 || length < 0){
+        return -1;
+    }
+    if (write && journal_begin_op() < 0){
+        journal_end_op();
+        return -1;
+    }
+    int inode_num = write ? lock_fd(fd, 1) : lock_fd_flushed(fd);
+    if (inode_num < 0){
+        if (write){
+            journal_end_op();
+        }
+        return -1;
+    }
+    if (write){
+        flush_wbuf(fd, inode_num);
+    }
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    inode_t *cur_inode = (inode_t *)&inode_table[inode_num];
+    int n = -1;
+    if (write && offset <= cur_inode->size){
+        int64_t pointer = offset;
+        int split = 0;
+        length = write_at(fd, inode_num, NULL, length, &pointer, &split);  //blocks that could be assigned within this call
+        ofdt[fd].map_off = offset;
+        n = 0;
+    }else if (!write){
+        int64_t data_avail = cur_inode->size - offset;
+        length = data_avail < length ? (int)(data_avail > 0 ? data_avail : 0) : length;
+        n = 0;
+    }
+    if (n == 0){
+        n = map_extents(fd, offset, length, ext, max_ext);
+        for (int i = 0; i < n; i++){   //partly written blocks and reads need the disk file up to date
+            int start;
+            int nblocks = extent_blocks(&ext[i], &start);
+            if (cache_flush_blocks(start, nblocks) < 0){
+                n = -1;
+                break;
+            }
+        }
+    }
+    if (n < 0){
+        ofdt[fd].map_off = -1;
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        if (write){
+            journal_end_op();
+        }
+        return -1;
+    }
+    pthread_mutex_lock(&ofdt[fd].lock);
+    ofdt[fd].map_count++;
+    pthread_mutex_unlock(&ofdt[fd].lock);
+    return n;
+}
+
+//ends the mapping sfs_map() returned for fd once the caller is done with its runs and unlocks the file
+//writing, done is the number of bytes written from the start of the mapping : the size is grown to cover
+//them and the cached copies of the runs are dropped, the disk file holding newer data
+//returns -1 if fd has no mapping in progress
+int sfs_unmap(int fd, const sfs_extent_t *ext, int n, int done){
+    if (fd_valid(fd) < 0){
+        return -1;
+    }
+    pthread_mutex_lock(&ofdt[fd].lock);
+    int mapped = ofdt[fd].map_count > 0;
+    if (mapped){
+        ofdt[fd].map_count--;
+    }
+    pthread_mutex_unlock(&ofdt[fd].lock);
+    if (!mapped){   //unmapped twice, the file is not locked for it
+        return -1;
+    }
+    int inode_num = ofdt[fd].inode;     //cannot be closed while mapped
+    if (ofdt[fd].map_off < 0){  //reading
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        return 0;
+    }
+    for (int i = 0; i < n; i++){
+        int start;
+        int nblocks = extent_blocks(&ext[i], &start);
+        cache_invalidate_blocks(start, nblocks);
+    }
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+    inode_t *cur_inode = (inode_t *)&inode_table[inode_num];
+    int64_t end = ofdt[fd].map_off + (done > 0 ? done : 0);
+    ofdt[fd].map_off = -1;
+    if (end > cur_inode->size){ //the data is in the disk file, it is committed with the size
+        cur_inode->size = end;
+        mark_inode_dirty(inode_num);
+        flush_metadata();
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    journal_end_op();
+    return 0;
+}
+
+//reads at offset without using or moving the file pointer, reads of one file run in parallel
+int sfs_pread(int fd, char *buf, int length, int64_t offset){
+    if (offset < 0){
+        return -1;
+    }
+    int inode_num = lock_fd_flushed(fd);
+    if (inode_num < 0){
+        return -1;
+    }
+    int res = read_at(fd, inode_num, buf, length, &offset);
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    return res;
+}
+
+//fills ext with the runs of the disk file holding length bytes of the file open in fd from pointer
+//stops at an unassigned block or once max_ext runs are filled, returns the number of runs
+int map_extents(int fd, int64_t pointer, int length, sfs_extent_t *ext, int max_ext){
+    int n = 0;
+    while (length > 0){
+        int disk_blk_num = bmap(fd, (int)(pointer / BLOCK_SIZE));
+        if (disk_blk_num == 0){
+            break;
+        }
+        int blk_ptr = (int)(pointer % BLOCK_SIZE);
+        int len = min(BLOCK_SIZE - blk_ptr, length);
+        int64_t disk_off = (int64_t)(data_loc + disk_blk_num) * BLOCK_SIZE + blk_ptr;
+        if (n > 0 && ext[n-1].disk_off + ext[n-1].len == disk_off){ //contiguous on disk, extend the run
+            ext[n-1].len += len;
+        }else{
+            if (n == max_ext){
+                break;
+            }
+            ext[n].disk_off = disk_off;
+            ext[n].len = len;
+            n++;
+        }
+        pointer = pointer + len;
+        length = length - len;
+    }
+    return n;
+}
+
+//first disk block of a run and number of blocks it touches
+int extent_blocks(const sfs_extent_t *ext, int *start){
+    *start = (int)(ext->disk_off / BLOCK_SIZE);
+    return (int)((ext->disk_off + ext->len + BLOCK_SIZE - 1) / BLOCK_SIZE) - *start;
+}
+
+//frees every block reached through indirect block blk (level 1 points to data blocks) and then blk itself
+//a leaf is freed whole, above it the pointer to each freed subtree is cleared and logged, so the tree
+//stays whole if the journal transaction fills up : returns 0 then (blk is not freed yet), 1 once it is
+int free_ptr_block(int blk, int level){
+    indirect_ptrs_t indirect_ptrs[PTRS_PER_BLK];    //own copy, called recursively for the lower levels
+    if (!data_blk_valid(blk)){  //a pointer read from a damaged disk, nothing to free
+        return 1;
+    }
+    cache_read_blocks(data_loc + blk, 1, indirect_ptrs);
+    for (int x = 0; x < PTRS_PER_BLK; x++){
+        if (data_blk_valid(indirect_ptrs[x].ptr) && level > 1){
+            if (!free_ptr_block(indirect_ptrs[x].ptr, level - 1)){
+                return 0;
+            }
+            indirect_ptrs[x].ptr = 0;
+            journal_write_block(data_loc + blk, indirect_ptrs);
+            flush_fbm();
+            if (journal_op_full()){
+                return 0;
+            }
+        }
+    }
+    pthread_mutex_lock(&alloc_lock);
+    for (int x = 0; x < PTRS_PER_BLK && level == 1; x++){
+        fbm_free(indirect_ptrs[x].ptr);
+    }
+    fbm_free(blk);
+    pthread_mutex_unlock(&alloc_lock);
+    journal_record(data_loc + blk, 0, JOURNAL_REVOKE, NULL);    //may be reused for data, its logged pointers must not be replayed
+    return 1;
+}
+
+//frees the blocks of inode_num, unlinked already (link count 0), and then the inode itself
+//in as many sfs_* calls as the journal needs : a crash in between leaves an orphan, finished at the next mount
+//the caller began a call and holds the inode write lock, both are let go here
+void free_orphan(int inode_num){
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
+    inode_t *cur_inode = (inode_t *)&inode_table[inode_num];
+    pthread_mutex_lock(&alloc_lock);
+    for (int x = 0; x<NUM_DIRECT; x++){
+        if (cur_inode->pointers[x] != 0){ //free used data blocks
+            fbm_free(cur_inode->pointers[x]);
+            cur_inode->pointers[x] = 0;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    //free the blocks reached through the indirect blocks, then the blocks themselves
+    int *roots[3] = {&cur_inode->ind_pointer, &cur_inode->dind_pointer, &cur_inode->tind_pointer};
+    for (int level = 1; level <= 3; level++){
+        while (*roots[level - 1] > 0 && !free_ptr_block(*roots[level - 1], level)){
+            mark_inode_dirty(inode_num);
+            flush_metadata();   //commit what was freed so far, go on in a new call
+            pthread_rwlock_unlock(&inode_locks[inode_num]);
+            journal_end_op();
+            if (journal_begin_op() < 0){ //left as an orphan for the next mount
+                journal_end_op();
+                return;
+            }
+            pthread_rwlock_wrlock(&inode_locks[inode_num]);
+        }
+        *roots[level - 1] = 0;
+    }
+    pthread_mutex_lock(&dir_lock);
+    free_map_set(inode_free, inode_num, 1);
+    pthread_mutex_unlock(&dir_lock);
+    mark_inode_dirty(inode_num);
+    flush_metadata();     //write inode and fbm into memory
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    journal_end_op();
+}
+
+//frees the inodes a crash left unlinked with blocks still assigned (see free_orphan), at mount
+void free_orphans(){
+    inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
+    for (int i = 1; i < TOTAL_INODE_ENTRIES; i++){
+        inode_t *inode = (inode_t *)&inode_table[i];
+        int used = inode->ind_pointer > 0 || inode->dind_pointer > 0 || inode->tind_pointer > 0;
+        for (int x = 0; x < NUM_DIRECT; x++){
+            used = used || inode->pointers[x] != 0;
+        }
+        if (inode->link_cnt == 0 && used){
+            if (journal_begin_op() < 0){
+                journal_end_op();
+                return;
+            }
+            pthread_rwlock_wrlock(&inode_locks[i]);
+            free_orphan(i);
+        }
     }
 }
 
 //remove file from the file syst
 int sfs_remove(char *fn){
     if (LOG){printf("-> Removing filename :  %s \n", fn);}
-    int inode_num = 0;
-    int dir_entry_num = 0;
-    //remove file from directory entry and retrieve inode number
-    dir_entry_t *dir = (dir_entry_t *)dir_mem; 
-    for (int i = 0; i < MAX_FILE_NUM; i++){  
-        if (strcmp(dir[i].filename,fn) == 0){
-            inode_num = dir[i].inode;
-            memset(dir[i].filename, '\0', sizeof(dir[i].filename));
-            dir[i].inode = 0;
-            dir_entry_num = i;
-            break; //break out of loop
-        }
-    }
-    //check if file is currently open in ofdt, if so return error -1
-    for (int y = 0; y<MAX_FILE_NUM; y++){
-        if (ofdt[y].inode == inode_num){ //if inode is in ofdt, return error
-            return -1;
-        }
+    //retrieve inode number, then look the file up again once its inode is locked
+    if (journal_begin_op() < 0){ //journal aborted, read-only until mounted again
+        journal_end_op();
+        return -1;
+    }
+    pthread_mutex_lock(&dir_lock);
+    int h = dir_hash_find(fn);
+    int inode_num = h >= 0 ? dir_hash[h].inode : 0;
+    pthread_mutex_unlock(&dir_lock);
+    if (h < 0){ //no such file
+        journal_end_op();
+        return -1;
+    }
+    pthread_rwlock_wrlock(&inode_locks[inode_num]);
+    pthread_mutex_lock(&dir_lock);
+    h = dir_hash_find(fn);
+    //check if file is currently open in ofdt (or was removed meanwhile), if so return error -1
+    if (h < 0 || dir_hash[h].inode != inode_num || inode_fd[inode_num] >= 0){
+        pthread_mutex_unlock(&dir_lock);
+        pthread_rwlock_unlock(&inode_locks[inode_num]);
+        journal_end_op();
+        return -1;
     }
+    int dir_entry_num = dir_hash[h].dir_entry_num;
+    //remove file from directory entry
+    dir_hash_remove(h);
+    dir_entry_t *dir = (dir_entry_t *)dir_mem; 
+    memset(dir[dir_entry_num].filename, '\0', sizeof(dir[dir_entry_num].filename));
+    dir[dir_entry_num].inode = 0;
+    free_map_set(dir_free, dir_entry_num, 1);
     write_dir_to_memory(dir_entry_num);             // write to memory selecting appropriate data block
-    fbm_map_t *fbm_map = (fbm_map_t *)fbm_map_mem; //free bit map
     
     //retrieve inode block 
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
@@ -800,52 +2330,80 @@ int sfs_remove(char *fn){
     cur_inode->link_cnt = 0;
     cur_inode->size = 0;
     cur_inode -> mode = 0;
-    for (int x = 0; x<12; x++){
-        if (cur_inode->pointers[x] != 0){ //free used data blocks
-            int datablk_index = cur_inode->pointers[x]; 
-            int fbm_index = datablk_index + 1 + INODE_TBL_SIZE; //conversion between inode pointers and fbm indices
-            fbm_map[fbm_index].available = 1; //free data block
-        }
-    }
-    write_blocks(inodetbl_loc, INODE_TBL_SIZE, inode_tbl_mem);     //write inode into memory
-    write_blocks(fbm_loc, FBM_SIZE, fbm_map_mem);     //write fbm into memory
+    mark_inode_dirty(inode_num);
+    pthread_mutex_unlock(&dir_lock);    //unreachable now, and not reused before its inode_free bit is set
+    free_orphan(inode_num);
     return 1;
 }
 
 //gets next filename in directory
 int sfs_getnextfilename(char *fn){
     dir_entry_t *dir = (dir_entry_t *)dir_mem; //retrieve directory
-    if (dir[current_file].inode == 0){ //if not in use, return 0
+    pthread_mutex_lock(&dir_lock);
+    if (current_file >= MAX_FILE_NUM || dir[current_file].inode == 0){ //if past the end or not in use, return 0
         current_file = 0;  //reset counter
+        pthread_mutex_unlock(&dir_lock);
         return 0;
     }
     strcpy(fn,dir[current_file].filename); //copy string
     current_file = current_file+1; 
+    pthread_mutex_unlock(&dir_lock);
     return 1;
 }
 
 
 //returns filesize 
 int sfs_getfilesize(const char* fn){ 
-    int inode_num = 0;
     int size = 0;
-    dir_entry_t *dir = (dir_entry_t *)dir_mem; //retrieve directory
-    for (int i = 0; i < MAX_FILE_NUM; i++){  
-        if (strcmp(dir[i].filename,fn) == 0){
-            inode_num = dir[i].inode;
-            if (inode_num == 0) {
-                return -1;
-            }
-            break; //break out of loop
-        }
+    pthread_mutex_lock(&dir_lock);
+    int h = dir_hash_find(fn); //retrieve directory entry
+    int inode_num = h >= 0 ? dir_hash[h].inode : 0;
+    pthread_mutex_unlock(&dir_lock);
+    if (h < 0) {    //no such file
+        return -1;
     }
 
+    pthread_rwlock_rdlock(&inode_locks[inode_num]);
     inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem; 
     inode_t *cur_inode = (inode_t *)&inode_table[inode_num];  
-    size = cur_inode->size;
+    int64_t filesize = cur_inode->size;
+    pthread_mutex_lock(&dir_lock);
+    int fd = inode_fd[inode_num];
+    pthread_mutex_unlock(&dir_lock);
+    if (fd >= 0 && ofdt[fd].wbuf_len > 0 && ofdt[fd].wbuf_off + ofdt[fd].wbuf_len > filesize){  //data still in the write buffer
+        filesize = ofdt[fd].wbuf_off + ofdt[fd].wbuf_len;
+    }
+    size = cur_inode->link_cnt == 0 ? -1 : filesize > INT_MAX ? INT_MAX : (int)filesize; //removed meanwhile, or the api reports sizes as int
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
     return size;
 }
 
+//makes every completed sfs_* call durable : commits the journal, writes back the cache and syncs the disk file
+//writes do not flush on their own, so this is the only place (with the exit) where durability is paid
+int sfs_sync(){
+    int res = 0;
+    flush_write_buffers();
+    if (journal_commit() < 0){
+        res = -1;
+    }
+    if (cache_sync() < 0){
+        res = -1;
+    }
+    if (sync_disk() < 0){
+        res = -1;
+    }
+    return res;
+}
+
+//makes what was written through fd durable
+//the cache does not know which file a block belongs to, so everything is written back as in sfs_sync
+int sfs_fsync(int fd){
+    if (fd_valid(fd) < 0){
+        return -1;
+    }
+    return sfs_sync();
+}
+
 
 
 //run with gcc -lm for floor fct
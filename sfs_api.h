@@ -1,10 +1,22 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <stdint.h>
+
+//run of a file in the disk file, see sfs_map()
+typedef struct _sfs_extent_t{
+    int64_t disk_off;   //byte offset in the disk file
+    int len;            //bytes
+}sfs_extent_t;
+
+#define MAXFILENAME 32     //longest file name, without the terminating 0
+
 // You can add more into this file.
 
 void mksfs(int);
 
+int sfs_mkfs(int, int, int);    //block size in bytes, disk size in blocks, number of inodes
+
 int sfs_getnextfilename(char*);
 
 int sfs_getfilesize(const char*);
@@ -19,8 +31,20 @@ int sfs_fread(int, char*, int);
 
 int sfs_fseek(int, int);
 
+int sfs_pread(int, char*, int, int64_t);         //reads at an offset, the file pointer is left alone
+
+int sfs_pwrite(int, const char*, int, int64_t);  //writes at an offset (at most the file size), the file pointer is left alone
+
+int sfs_map(int, int64_t, int, int, sfs_extent_t*, int);    //file range -> runs of the disk file, for transfers bypassing sfs
+
+int sfs_unmap(int, const sfs_extent_t*, int, int);  //ends a mapping (bytes written), the file stays locked until then
+
 int sfs_remove(char*);
 
+int sfs_fsync(int);             //makes what was written to the file durable
+
+int sfs_sync();                 //makes every completed call durable
+
 
 
 
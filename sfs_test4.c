@@ -0,0 +1,454 @@
+/* sfs_test4.c
+ *
+ * Crash tests for the journal: a writer process changes the file
+ * system and exits without closing it (no checkpoint, so the home
+ * blocks of the last transactions are never written), then a checker
+ * process mounts the disk with mksfs(0) and checks the metadata that
+ * was replayed: names, sizes, data and the free block map.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+#include "sfs.c"
+
+static int error_count = 0;
+
+void red () {
+  printf("\033[1;31m");
+}
+
+void reset () {
+  printf("\033[0m");
+}
+
+void error(const char *what, const char *name) {
+  red();
+  printf("ERROR: %s %s\n", what, name);
+  reset();
+  error_count++;
+}
+
+/* Byte i of the file with the given seed.
+ */
+char pattern(int seed, int i) {
+  return (char)((i * 31 + seed * 7) % 251);
+}
+
+void make_file(const char *name, int len, int seed) {
+  char *buf = malloc(len);
+  int i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = pattern(seed, i);
+  }
+  int fd = sfs_fopen((char *)name);
+  if (fd < 0 || sfs_fwrite(fd, buf, len) != len) {
+    error("writing", name);
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+void check_file(const char *name, int len, int seed) {
+  char *buf = calloc(len + 1, 1);
+  int i;
+
+  if (sfs_getfilesize(name) != len) {
+    error("wrong size after replay for", name);
+  }
+  int fd = sfs_fopen((char *)name);
+  sfs_fseek(fd, 0);
+  if (fd < 0 || sfs_fread(fd, buf, len) != len) {
+    error("reading back", name);
+  }
+  for (i = 0; i < len; i++) {
+    if (buf[i] != pattern(seed, i)) {
+      error("wrong data after replay in", name);
+      break;
+    }
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+/* Marks blk as reached, a block reached twice or marked free in the
+ * fbm is an error. Indirect blocks are walked down to the data.
+ */
+static char *reached;
+static int nreached;
+
+void reach(int blk, int level) {
+  if (blk <= 0) {
+    return;
+  }
+  if (reached[blk] || fbm_is_free(data_loc + blk)) {
+    error("block reached twice or free in the fbm:", "");
+    return;
+  }
+  reached[blk] = 1;
+  nreached++;
+  if (level > 0) {
+    indirect_ptrs_t *ptrs = malloc(BLOCK_SIZE);
+    int x;
+    cache_read_blocks(data_loc + blk, 1, ptrs);
+    for (x = 0; x < PTRS_PER_BLK; x++) {
+      reach(ptrs[x].ptr, level - 1);
+    }
+    free(ptrs);
+  }
+}
+
+/* Every block used in the fbm is reached from exactly one file.
+ */
+void check_fbm() {
+  inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+  int i, x, used = 0;
+
+  reached = calloc(FILE_SYST_SIZE, 1);
+  nreached = 0;
+  for (i = 0; i < TOTAL_INODE_ENTRIES; i++) {
+    inode_t *inode = (inode_t *)&inode_table[i];
+    if (inode->link_cnt == 0) {  /* the blocks of a free inode count as leaked */
+      continue;
+    }
+    for (x = 0; x < NUM_DIRECT; x++) {
+      reach(inode->pointers[x], 0);
+    }
+    reach(inode->ind_pointer, 1);
+    reach(inode->dind_pointer, 2);
+    reach(inode->tind_pointer, 3);
+  }
+  for (i = data_loc + 1; i < fbm_loc; i++) {  /* block 0 is the first directory block */
+    used += !fbm_is_free(i);
+  }
+  if (used != nreached) {
+    printf("%d blocks used, %d reached\n", used, nreached);
+    error("blocks leaked in the fbm", "");
+  }
+  free(reached);
+}
+
+/* Committed files are replayed, the ones after the last commit are
+ * lost with it.
+ */
+void write_replay() {
+  mksfs(1);
+  make_file("small.txt", 700, 1);
+  make_file("direct.bin", 9000, 2);
+  make_file("indirect.bin", 40000, 3);
+  make_file("removed.bin", 30000, 4);
+  sfs_remove("removed.bin");
+  cache_sync();                 /* the data is on the disk, the metadata only in the log */
+  journal_commit();
+  make_file("lost.txt", 5000, 5);
+  _exit(0);
+}
+
+void check_replay() {
+  journal_stats_t stats;
+
+  mksfs(0);
+  journal_get_stats(&stats);
+  if (stats.replayed == 0) {
+    error("nothing replayed, the checkpoint was not skipped", "");
+  }
+  check_file("small.txt", 700, 1);
+  check_file("direct.bin", 9000, 2);
+  check_file("indirect.bin", 40000, 3);
+  if (sfs_getfilesize("removed.bin") >= 0) {
+    error("removed file is back:", "removed.bin");
+  }
+  if (sfs_getfilesize("lost.txt") >= 0) {
+    error("uncommitted file was replayed:", "lost.txt");
+  }
+  check_fbm();
+}
+
+/* A transaction whose last block did not reach the disk is dropped
+ * whole, the ones before it are replayed.
+ */
+void write_torn() {
+  char name[16];
+  int i, head;
+
+  mksfs(1);
+  make_file("kept.bin", 20000, 6);
+  cache_sync();
+  journal_commit();
+  head = jnl_head;
+  for (i = 0; i < 5; i++) {     /* their indirect blocks take a few log blocks */
+    sprintf(name, "torn%d.bin", i);
+    make_file(name, 20000, 7 + i);
+  }
+  cache_sync();
+  journal_commit();
+  if (jnl_head - head < 2) {
+    error("the transaction fits in one block, nothing to tear", "");
+  }
+  memset(jnl_blk, 0x5a, BLOCK_SIZE);
+  write_blocks(jnl_loc + jnl_head - 1, 1, jnl_blk);
+  flush_disk();                 /* out of the stdio buffer with that backend */
+  fflush(stdout);
+  _exit(error_count);
+}
+
+void check_torn() {
+  char name[16];
+  int i;
+
+  mksfs(0);
+  check_file("kept.bin", 20000, 6);
+  for (i = 0; i < 5; i++) {
+    sprintf(name, "torn%d.bin", i);
+    if (sfs_getfilesize(name) >= 0) {
+      error("torn transaction was replayed:", name);
+    }
+  }
+  check_fbm();
+}
+
+/* An indirect block is logged, freed and reused for the data of
+ * another file: the revoke record keeps the replay off that data.
+ */
+static int revoke_sizes[3] = { 10 * 1024, 10 * 1024, 2 * 1024 };
+
+void write_revoke() {
+  char buf[1024], name[16];
+  int fd, old_ind, reused, i, x;
+  journal_stats_t stats;
+
+  sfs_mkfs(1024, 2048, 32);
+  make_file("hole.txt", 1000, 8);
+  make_file("a.bin", 20 * 1024, 9);
+  memset(buf, 'f', sizeof(buf));
+  fd = sfs_fopen("filler");
+  while (sfs_fwrite(fd, buf, sizeof(buf)) == sizeof(buf)) {
+  }
+  sfs_fclose(fd);
+  sfs_sync();                   /* empties the log */
+  journal_get_stats(&stats);
+  long checkpoints = stats.checkpoints;
+
+  sfs_remove("hole.txt");       /* the only free block, a.bin grows into it */
+  fd = sfs_fopen("a.bin");
+  sfs_fwrite(fd, buf, sizeof(buf));
+  sfs_fclose(fd);
+  journal_commit();             /* the indirect block of a.bin is in the log */
+
+  old_ind = ((inode_t *)&((inode_table_t *)inode_tbl_mem)[dir_hash[dir_hash_find("a.bin")].inode])->ind_pointer;
+  sfs_remove("a.bin");
+  journal_commit();             /* its blocks are allocated again once the remove committed */
+  reused = 0;
+  for (i = 0; i < 3; i++) {     /* direct blocks only, so the old indirect block holds data */
+    sprintf(name, "b%d.bin", i);
+    make_file(name, revoke_sizes[i], 11 + i);
+    int b = dir_hash[dir_hash_find(name)].inode;
+    for (x = 0; x < NUM_DIRECT; x++) {
+      reused = reused || inode_bmap(b, x, 0) == old_ind;
+    }
+  }
+  if (!reused) {
+    error("the old indirect block was not reused for data", "");
+  }
+  cache_sync();
+  journal_commit();
+  journal_get_stats(&stats);
+  if (stats.checkpoints != checkpoints) {
+    error("the log was checkpointed, nothing left to revoke", "");
+  }
+  fflush(stdout);
+  _exit(error_count);
+}
+
+void check_revoke() {
+  char name[16];
+  int i;
+
+  mksfs(0);
+  if (sfs_getfilesize("a.bin") >= 0) {
+    error("removed file is back:", "a.bin");
+  }
+  for (i = 0; i < 3; i++) {
+    sprintf(name, "b%d.bin", i);
+    check_file(name, revoke_sizes[i], 11 + i);
+  }
+  check_fbm();
+}
+
+/* A remove cut short after its first call (the file unlinked, its
+ * blocks still assigned) is finished at the next mount.
+ */
+void write_orphan() {
+  mksfs(1);
+  make_file("orphan.bin", 300 * 1024, 12);    /* through the double indirect block */
+  make_file("other.bin", 3000, 13);
+  sfs_sync();
+
+  dir_entry_t *dir = (dir_entry_t *)dir_mem;
+  inode_table_t *inode_table = (inode_table_t *)inode_tbl_mem;
+
+  journal_begin_op();
+  pthread_mutex_lock(&dir_lock);
+  int h = dir_hash_find("orphan.bin");
+  int inode_num = dir_hash[h].inode;
+  int dir_entry_num = dir_hash[h].dir_entry_num;
+  dir_hash_remove(h);
+  memset(dir[dir_entry_num].filename, '\0', sizeof(dir[dir_entry_num].filename));
+  dir[dir_entry_num].inode = 0;
+  free_map_set(dir_free, dir_entry_num, 1);
+  write_dir_to_memory(dir_entry_num);
+  ((inode_t *)&inode_table[inode_num])->link_cnt = 0;
+  ((inode_t *)&inode_table[inode_num])->size = 0;
+  mark_inode_dirty(inode_num);
+  flush_metadata();
+  pthread_mutex_unlock(&dir_lock);
+  journal_end_op();
+  journal_commit();
+  _exit(0);
+}
+
+void check_orphan() {
+  mksfs(0);
+  if (sfs_getfilesize("orphan.bin") >= 0) {
+    error("unlinked file is back:", "orphan.bin");
+  }
+  check_file("other.bin", 3000, 13);
+  check_fbm();
+}
+
+/* On a full disk, a file is removed and another one written before
+ * the remove commits: the blocks of the removed file must not take the
+ * new data, the replay brings the file back whole and it can still be
+ * removed.
+ */
+void write_freed() {
+  char *buf = malloc(64 * 1024);
+  journal_stats_t stats;
+  long commits;
+
+  mksfs(1);
+  make_file("old.bin", 20 * 1024, 14);        /* through the indirect block */
+  memset(buf, 0x42, 64 * 1024);
+  int fd = sfs_fopen("filler");
+  while (sfs_fwrite(fd, buf, 1024) == 1024) {
+  }
+  sfs_fclose(fd);
+  sfs_sync();
+  journal_get_stats(&stats);
+  commits = stats.commits;
+
+  sfs_remove("old.bin");
+  fd = sfs_fopen("new.bin");
+  sfs_fwrite(fd, buf, 64 * 1024);             /* gets no block before the commit */
+  sfs_fclose(fd);
+  cache_sync();                 /* what was written is home, the remove only in the cache */
+  journal_get_stats(&stats);
+  if (stats.commits != commits) {
+    error("the remove was committed, nothing to check", "");
+  }
+  free(buf);
+  fflush(stdout);
+  _exit(error_count);
+}
+
+void check_freed() {
+  mksfs(0);
+  check_file("old.bin", 20 * 1024, 14);
+  if (sfs_getfilesize("new.bin") >= 0) {
+    error("uncommitted file was replayed:", "new.bin");
+  }
+  check_fbm();
+  if (sfs_remove("old.bin") < 0) {
+    error("could not remove the replayed file", "old.bin");
+  }
+  check_fbm();
+}
+
+/* A transaction that does not fit in the log aborts the journal: its
+ * held blocks are dropped, the calls that change the file system fail
+ * from then on, and the next mount finds the last committed state.
+ */
+void write_aborted() {
+  char buf[100];
+
+  mksfs(1);
+  make_file("kept.bin", 3000, 16);
+  int kept = sfs_fopen("kept.bin");
+  sfs_sync();
+  jnl_head = jnl_nblocks;       /* no room left in the log */
+
+  make_file("dropped.bin", 3000, 17);
+  if (journal_commit() >= 0) {
+    error("a transaction larger than the log was committed", "");
+  }
+  if (cache_held() != 0) {
+    error("held blocks were kept after the abort", "");
+  }
+  if (sfs_fopen("new.bin") >= 0 || sfs_remove("dropped.bin") >= 0
+      || sfs_pwrite(kept, buf, sizeof(buf), 0) >= 0 || sfs_fseek(kept, 0) >= 0) {
+    error("a call changed the file system after the abort", "");
+  }
+  if (sfs_pread(kept, buf, sizeof(buf), 0) != sizeof(buf) || buf[10] != pattern(16, 10)) {
+    error("an open file could not be read after the abort", "");
+  }
+  fflush(stdout);
+  _exit(error_count);
+}
+
+void check_aborted() {
+  mksfs(0);
+  check_file("kept.bin", 3000, 16);
+  if (sfs_getfilesize("dropped.bin") >= 0) {
+    error("file of the aborted transaction is back:", "dropped.bin");
+  }
+  check_fbm();
+}
+
+/* Runs fn in a child process, returns its error count.
+ */
+int run(void (*fn)()) {
+  int status;
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    fn();
+    fflush(stdout);
+    _exit(error_count > 255 ? 255 : error_count);
+  }
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int
+main()
+{
+  int errors = 0;
+
+  printf("Replay of committed transactions\n");
+  errors += run(write_replay);
+  errors += run(check_replay);
+  printf("Torn transaction\n");
+  errors += run(write_torn);
+  errors += run(check_torn);
+  printf("Revoked block reused for data\n");
+  errors += run(write_revoke);
+  errors += run(check_revoke);
+  printf("Remove cut short\n");
+  errors += run(write_orphan);
+  errors += run(check_orphan);
+  printf("Blocks of an uncommitted remove\n");
+  errors += run(write_freed);
+  errors += run(check_freed);
+  printf("Aborted journal\n");
+  errors += run(write_aborted);
+  errors += run(check_aborted);
+
+  printf("Test program exiting with %d errors\n", errors);
+  return errors;
+}
@@ -0,0 +1,198 @@
+/* sfs_test5.c
+ *
+ * Multithreaded test: threads write and read stripes of shared files
+ * with sfs_pwrite/sfs_pread while creating and removing files of their
+ * own, then the contents are checked again after a remount.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs_api.h"
+#include "sfs.c"
+
+#define NTHREADS 4
+#define NSHARED 2
+#define NSTRIPES 12             /* stripes of each thread in a shared file */
+#define STRIPE 3000             /* not a multiple of the block size */
+#define ROUNDS 40
+#define SHARED_SIZE (NTHREADS * NSTRIPES * STRIPE)
+
+static int shared_fd[NSHARED];
+static int errors[NTHREADS];
+
+void red () {
+  printf("\033[1;31m");
+}
+
+void reset () {
+  printf("\033[0m");
+}
+
+void error(int id, const char *what) {
+  red();
+  printf("ERROR: thread %d: %s\n", id, what);
+  reset();
+  errors[id]++;
+}
+
+/* Fills a stripe written by thread id in the given round, every byte
+ * depends on both so a mixed stripe is noticed.
+ */
+void fill(char *buf, int id, int round, int stripe) {
+  int i;
+
+  for (i = 0; i < STRIPE; i++) {
+    buf[i] = (char)(id * 61 + round * 7 + stripe * 3 + i % 13);
+  }
+}
+
+/* Returns the round a stripe of thread id was written in (0 if not
+ * written yet), -1 if it is not one whole stripe of that thread.
+ */
+int round_of(const char *buf, int id, int stripe) {
+  char expect[STRIPE];
+  int round;
+
+  memset(expect, 0, STRIPE);
+  if (memcmp(buf, expect, STRIPE) == 0) {
+    return 0;
+  }
+  for (round = 1; round <= ROUNDS; round++) {
+    fill(expect, id, round, stripe);
+    if (memcmp(buf, expect, STRIPE) == 0) {
+      return round;
+    }
+  }
+  return -1;
+}
+
+int64_t stripe_off(int id, int stripe) {
+  return (int64_t)(stripe * NTHREADS + id) * STRIPE;
+}
+
+void *worker(void *arg) {
+  int id = (int)(long)arg;
+  char buf[STRIPE], own[32], data[5000];
+  int round, s, f, other;
+
+  sprintf(own, "own%d.dat", id);
+  memset(data, 'a' + id, sizeof(data));
+  for (round = 1; round <= ROUNDS; round++) {
+    for (f = 0; f < NSHARED; f++) {
+      for (s = 0; s < NSTRIPES; s++) {
+        fill(buf, id, round, s);
+        if (sfs_pwrite(shared_fd[f], buf, STRIPE, stripe_off(id, s)) != STRIPE) {
+          error(id, "short sfs_pwrite");
+        }
+      }
+      /* own stripes come back as written, the others whole */
+      for (s = 0; s < NSTRIPES; s++) {
+        if (sfs_pread(shared_fd[f], buf, STRIPE, stripe_off(id, s)) != STRIPE
+            || round_of(buf, id, s) != round) {
+          error(id, "own stripe changed");
+        }
+        other = (id + 1 + s) % NTHREADS;
+        if (sfs_pread(shared_fd[f], buf, STRIPE, stripe_off(other, s)) != STRIPE
+            || round_of(buf, other, s) < 0) {
+          error(id, "stripe of another thread torn");
+        }
+      }
+    }
+
+    /* files of its own are created and removed meanwhile */
+    int fd = sfs_fopen(own);
+    if (fd < 0 || sfs_fwrite(fd, data, sizeof(data)) != sizeof(data)) {
+      error(id, "writing its own file");
+    }
+    sfs_fclose(fd);
+    if (sfs_getfilesize(own) != sizeof(data)) {
+      error(id, "wrong size of its own file");
+    }
+    if (sfs_remove(own) != 1) {
+      error(id, "removing its own file");
+    }
+    if (sfs_remove("shared0.dat") >= 0) {
+      error(id, "removed a file that is open");
+    }
+  }
+  return NULL;
+}
+
+/* Every stripe holds the last round of its thread.
+ */
+int check_shared(const char *when) {
+  char buf[STRIPE], name[32];
+  int f, id, s, errs = 0;
+
+  for (f = 0; f < NSHARED; f++) {
+    sprintf(name, "shared%d.dat", f);
+    if (sfs_getfilesize(name) != SHARED_SIZE) {
+      red();
+      printf("ERROR: %s: wrong size of %s\n", when, name);
+      reset();
+      errs++;
+    }
+    for (id = 0; id < NTHREADS; id++) {
+      for (s = 0; s < NSTRIPES; s++) {
+        if (sfs_pread(shared_fd[f], buf, STRIPE, stripe_off(id, s)) != STRIPE
+            || round_of(buf, id, s) != ROUNDS) {
+          red();
+          printf("ERROR: %s: stripe %d of thread %d in %s\n", when, s, id, name);
+          reset();
+          errs++;
+        }
+      }
+    }
+  }
+  return errs;
+}
+
+int
+main()
+{
+  pthread_t threads[NTHREADS];
+  char *zero = calloc(SHARED_SIZE, 1);
+  char name[32];
+  int i, error_count = 0;
+
+  mksfs(1);
+  for (i = 0; i < NSHARED; i++) {
+    sprintf(name, "shared%d.dat", i);
+    shared_fd[i] = sfs_fopen(name);
+    if (sfs_fwrite(shared_fd[i], zero, SHARED_SIZE) != SHARED_SIZE) {
+      printf("ERROR: could not create %s\n", name);
+      error_count++;
+    }
+  }
+
+  for (i = 0; i < NTHREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+  }
+  for (i = 0; i < NTHREADS; i++) {
+    pthread_join(threads[i], NULL);
+    error_count += errors[i];
+  }
+  error_count += check_shared("after the threads");
+
+  for (i = 0; i < NSHARED; i++) {
+    sfs_fclose(shared_fd[i]);
+  }
+  mksfs(0);
+  for (i = 0; i < NSHARED; i++) {
+    sprintf(name, "shared%d.dat", i);
+    shared_fd[i] = sfs_fopen(name);
+  }
+  error_count += check_shared("after a remount");
+  while (sfs_getnextfilename(name)) {
+    if (strncmp(name, "own", 3) == 0) {
+      printf("ERROR: removed file %s is still listed\n", name);
+      error_count++;
+    }
+  }
+
+  printf("Test program exiting with %d errors\n", error_count);
+  free(zero);
+  return error_count;
+}
@@ -0,0 +1,135 @@
+/* sfs_test6.c
+ *
+ * Write buffer test: small writes are gathered in the write buffer of
+ * the descriptor, they are read back and the size is checked while
+ * the data is still buffered, after sfs_fclose and after a remount.
+ * Once the files are closed no block is left reserved, and removing
+ * them frees every block they took.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs.c"
+
+#define PIECE 333               /* not a multiple of the block size */
+#define NPIECES 300             /* fills the write buffer a few times */
+#define FILE_LEN (PIECE * NPIECES)
+#define PATCH_OFF 5000
+#define PATCH_LEN 100
+
+static int error_count = 0;
+
+void red () {
+  printf("\033[1;31m");
+}
+
+void reset () {
+  printf("\033[0m");
+}
+
+void error(const char *what) {
+  red();
+  printf("ERROR: %s\n", what);
+  reset();
+  error_count++;
+}
+
+/* Byte i of the file, the patch written over it excepted.
+ */
+char pattern(int i) {
+  return (char)((i * 13 + i / PIECE) % 251);
+}
+
+char expected(int i, int patched) {
+  if (patched && i >= PATCH_OFF && i < PATCH_OFF + PATCH_LEN) {
+    return 'p';
+  }
+  return pattern(i);
+}
+
+/* The first len bytes of the file hold the pattern.
+ */
+void check_data(int fd, int len, int patched, const char *when) {
+  char *buf = calloc(len, 1);
+  int i;
+
+  if (sfs_pread(fd, buf, len, 0) != len) {
+    printf("%s: ", when);
+    error("short read");
+  }
+  for (i = 0; i < len; i++) {
+    if (buf[i] != expected(i, patched)) {
+      printf("%s: byte %d ", when, i);
+      error("has the wrong data");
+      break;
+    }
+  }
+  free(buf);
+}
+
+void check_size(const char *name, int len, const char *when) {
+  if (sfs_getfilesize(name) != len) {
+    printf("%s: size %d instead of %d ", when, sfs_getfilesize(name), len);
+    error("wrong file size");
+  }
+}
+
+int
+main()
+{
+  char piece[PIECE], patch[PATCH_LEN];
+  int fd, i, k, nfree;
+
+  mksfs(1);
+  fd = sfs_fopen("buffered.dat");
+  nfree = fbm_nfree;            /* the directory took its block */
+  for (i = 0; i < NPIECES; i++) {
+    for (k = 0; k < PIECE; k++) {
+      piece[k] = pattern(i * PIECE + k);
+    }
+    if (sfs_fwrite(fd, piece, PIECE) != PIECE) {
+      error("short sfs_fwrite");
+    }
+    if (i % 50 == 49) {         /* the last pieces are still in the buffer */
+      if (ofdt[fd].wbuf_len == 0) {
+        error("the small writes were not buffered");
+      }
+      check_size("buffered.dat", (i + 1) * PIECE, "buffered");
+      check_data(fd, (i + 1) * PIECE, 0, "buffered");
+    }
+  }
+
+  /* a write that does not follow the buffer flushes it */
+  memset(patch, 'p', PATCH_LEN);
+  sfs_fseek(fd, PATCH_OFF);
+  if (sfs_fwrite(fd, patch, PATCH_LEN) != PATCH_LEN) {
+    error("short sfs_fwrite of the patch");
+  }
+  check_size("buffered.dat", FILE_LEN, "patched");
+  check_data(fd, FILE_LEN, 1, "patched");
+
+  sfs_fclose(fd);
+  check_size("buffered.dat", FILE_LEN, "after sfs_fclose");
+  if (wbuf_reserved != 0) {
+    error("blocks still reserved after sfs_fclose");
+  }
+  fd = sfs_fopen("buffered.dat");
+  check_data(fd, FILE_LEN, 1, "after sfs_fclose");
+  sfs_fclose(fd);
+
+  mksfs(0);
+  check_size("buffered.dat", FILE_LEN, "after a remount");
+  fd = sfs_fopen("buffered.dat");
+  check_data(fd, FILE_LEN, 1, "after a remount");
+  sfs_fclose(fd);
+
+  sfs_remove("buffered.dat");
+  if (fbm_nfree != nfree) {
+    printf("%d blocks free instead of %d ", fbm_nfree, nfree);
+    error("blocks leaked by the buffered writes");
+  }
+  printf("Test program exiting with %d errors\n", error_count);
+  return error_count;
+}
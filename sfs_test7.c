@@ -0,0 +1,240 @@
+/* sfs_test7.c
+ *
+ * Geometry test: the disk is formatted with sfs_mkfs in a few
+ * geometries other than the default one, files reaching the indirect
+ * blocks are written, the disk is filled up and every file (and the
+ * number of inodes) is checked again after mksfs(0) read the geometry
+ * back from the superblock. Geometries that cannot work are refused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs.c"
+
+#define NFILES 3
+
+typedef struct {
+  int block_size, num_blocks, num_inodes;
+} geometry_t;
+
+static geometry_t geometries[] = {
+  { 512, 4096, 40 },            /* small blocks, many indirect levels used */
+  { 4096, 1500, 300 },
+  { 8192, 600, 10 },            /* fewer inodes than fit in one table block */
+  { 65536, 64, 4 },             /* largest block size */
+};
+
+static int error_count = 0;
+
+void red () {
+  printf("\033[1;31m");
+}
+
+void reset () {
+  printf("\033[0m");
+}
+
+void error(const geometry_t *g, const char *what) {
+  red();
+  printf("ERROR: %d byte blocks: %s\n", g->block_size, what);
+  reset();
+  error_count++;
+}
+
+char pattern(int file, int i) {
+  return (char)((i * 7 + file * 101 + i / 4099) % 253);
+}
+
+/* Length of test file f, through the double indirect block when the
+ * disk has room for it.
+ */
+int file_len(const geometry_t *g, int f) {
+  int bs = g->block_size;
+  int ptrs = bs / (int)sizeof(indirect_ptrs_t);
+  int len = (NUM_DIRECT + ptrs + 2) * bs + 123 * (f + 1);
+  int room = (g->num_blocks / 4 / NFILES) * bs;
+
+  return len < room ? len : room - 17 * (f + 1);
+}
+
+void write_files(const geometry_t *g) {
+  char name[16];
+  int f, i;
+
+  for (f = 0; f < NFILES; f++) {
+    int len = file_len(g, f);
+    char *buf = malloc(len);
+    for (i = 0; i < len; i++) {
+      buf[i] = pattern(f, i);
+    }
+    sprintf(name, "geo%d.bin", f);
+    int fd = sfs_fopen(name);
+    if (fd < 0 || sfs_fwrite(fd, buf, len) != len) {
+      error(g, "writing a test file");
+    }
+    sfs_fclose(fd);
+    free(buf);
+  }
+}
+
+void check_files(const geometry_t *g, const char *when) {
+  char name[16];
+  int f, i;
+
+  for (f = 0; f < NFILES; f++) {
+    int len = file_len(g, f);
+    char *buf = calloc(len, 1);
+    sprintf(name, "geo%d.bin", f);
+    if (sfs_getfilesize(name) != len) {
+      printf("%s: ", when);
+      error(g, "wrong file size");
+    }
+    int fd = sfs_fopen(name);
+    sfs_fseek(fd, 0);
+    if (fd < 0 || sfs_fread(fd, buf, len) != len) {
+      printf("%s: ", when);
+      error(g, "short read");
+    }
+    for (i = 0; i < len; i++) {
+      if (buf[i] != pattern(f, i)) {
+        printf("%s: byte %d of %s ", when, i, name);
+        error(g, "has the wrong data");
+        break;
+      }
+    }
+    sfs_fclose(fd);
+    free(buf);
+  }
+}
+
+/* Number of free data blocks in the fbm.
+ */
+int count_free() {
+  int blk, n = 0;
+
+  for (blk = data_loc; blk < fbm_loc; blk++) {
+    n += fbm_is_free(blk);
+  }
+  return n;
+}
+
+/* Writes until the disk is full, returns the bytes written.
+ */
+long fill_disk(const geometry_t *g) {
+  char *buf = calloc(g->block_size, 1);
+  long total = 0;
+  int n;
+
+  memset(buf, 'f', g->block_size);
+  int fd = sfs_fopen("filler");
+  while ((n = sfs_fwrite(fd, buf, g->block_size)) > 0) {
+    total = total + n;
+    if (n < g->block_size) {
+      break;
+    }
+  }
+  sfs_fclose(fd);
+  free(buf);
+  return total;
+}
+
+/* Creates empty files until there is no inode left, returns how many
+ * could be created, and removes them again.
+ */
+int count_inodes() {
+  char name[16];
+  int n = 0, i;
+
+  for (;;) {
+    sprintf(name, "i%d", n);
+    int fd = sfs_fopen(name);
+    if (fd < 0) {
+      break;
+    }
+    sfs_fclose(fd);
+    n++;
+  }
+  for (i = 0; i < n; i++) {
+    sprintf(name, "i%d", i);
+    sfs_remove(name);
+  }
+  return n;
+}
+
+void run(const geometry_t *g) {
+  int inodes_per_blk = g->block_size / (int)sizeof(inode_t);
+  int files = (g->num_inodes + inodes_per_blk - 1) / inodes_per_blk * inodes_per_blk - 1;
+
+  printf("%d byte blocks, %d blocks, %d inodes\n", g->block_size, g->num_blocks, g->num_inodes);
+  if (sfs_mkfs(g->block_size, g->num_blocks, g->num_inodes) < 0) {
+    error(g, "the geometry was refused");
+    return;
+  }
+  if (BLOCK_SIZE != g->block_size || FILE_SYST_SIZE != g->num_blocks) {
+    error(g, "the geometry was not applied");
+  }
+  write_files(g);
+  check_files(g, "written");
+
+  int nfree = count_free();
+  long filled = fill_disk(g);
+  long data = (long)(fbm_loc - data_loc) * g->block_size;
+  if (filled <= 0 || filled > data) {
+    error(g, "the filler does not match the data blocks");
+  }
+  sfs_remove("filler");
+  if (count_free() != nfree) {
+    error(g, "the blocks of the removed filler were not given back");
+  }
+  if (count_inodes() != files - NFILES) {
+    error(g, "wrong number of files could be created");
+  }
+
+  mksfs(0);
+  if (BLOCK_SIZE != g->block_size || FILE_SYST_SIZE != g->num_blocks) {
+    error(g, "the geometry was not read back");
+  }
+  check_files(g, "after a remount");
+  if (count_inodes() != files - NFILES) {
+    error(g, "wrong number of files after a remount");
+  }
+  filled = fill_disk(g);         /* the directory may have grown meanwhile */
+  if (filled <= 0 || filled > data) {
+    error(g, "the disk could not be filled after a remount");
+  }
+}
+
+int
+main()
+{
+  int i;
+
+  for (i = 0; i < (int)(sizeof(geometries) / sizeof(geometries[0])); i++) {
+    run(&geometries[i]);
+  }
+
+  printf("Geometries that cannot work\n");
+  if (sfs_mkfs(1000, 2000, 100) >= 0) {
+    printf("ERROR: a block size that is not a power of 2 was accepted\n");
+    error_count++;
+  }
+  if (sfs_mkfs(256, 2000, 100) >= 0 || sfs_mkfs(131072, 100, 10) >= 0) {
+    printf("ERROR: a block size out of bounds was accepted\n");
+    error_count++;
+  }
+  if (sfs_mkfs(1024, 10, 100) >= 0 || sfs_mkfs(1024, 2000, 1) >= 0) {
+    printf("ERROR: a disk too small for its tables was accepted\n");
+    error_count++;
+  }
+
+  mksfs(1);                     /* back to the default geometry */
+  if (BLOCK_SIZE != 1024 || FILE_SYST_SIZE != 2000) {
+    printf("ERROR: mksfs(1) did not restore the default geometry\n");
+    error_count++;
+  }
+
+  printf("Test program exiting with %d errors\n", error_count);
+  return error_count;
+}
@@ -0,0 +1,157 @@
+/* sfs_test8.c
+ *
+ * Positional I/O test: sfs_pwrite and sfs_pread at arbitrary offsets
+ * (inside a block, across block boundaries and into the indirect
+ * blocks, overwriting and appending) are checked against a copy of the
+ * file kept in memory, the file pointer must not move, and the file is
+ * compared whole again after a remount.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs.c"
+
+#define MAX_LEN (400 * 1024)    /* through the double indirect block */
+#define MAX_IO 5000
+#define ROUNDS 3000
+#define SEEK_POS 777
+
+static char *copy;              /* what the file should hold */
+static int copy_len = 0;
+static int error_count = 0;
+static unsigned int seed = 12345;
+
+void red () {
+  printf("\033[1;31m");
+}
+
+void reset () {
+  printf("\033[0m");
+}
+
+void error(int round, const char *what) {
+  red();
+  printf("ERROR: round %d: %s\n", round, what);
+  reset();
+  error_count++;
+}
+
+/* The offsets do not depend on rand(), which the disk seeds with the time.
+ */
+int next(int n) {
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 8) % (unsigned int)n);
+}
+
+/* Reads back the whole file with the file pointer and compares it.
+ */
+void check_whole(int fd, const char *when) {
+  char *buf = calloc(MAX_LEN, 1);
+
+  sfs_fseek(fd, 0);
+  if (sfs_fread(fd, buf, MAX_LEN) != copy_len || memcmp(buf, copy, copy_len) != 0) {
+    printf("%s: ", when);
+    error(ROUNDS, "the file does not hold what was written");
+  }
+  free(buf);
+}
+
+int
+main()
+{
+  char wbuf[MAX_IO], rbuf[MAX_IO + 1];
+  int fd, round, i;
+
+  copy = calloc(MAX_LEN, 1);
+  mksfs(1);
+  fd = sfs_fopen("positional.bin");
+
+  for (round = 0; round < ROUNDS; round++) {
+    int len = 1 + next(next(8) == 0 ? MAX_IO : 300);    /* mostly small ones */
+    int off = next(copy_len + 1);
+    if (next(4) == 0) {
+      off = copy_len;           /* appends */
+    } else if (next(3) == 0) {
+      off = off / BLOCK_SIZE * BLOCK_SIZE + BLOCK_SIZE - 1 - next(3);     /* across a block boundary */
+      off = off > copy_len ? copy_len : off;
+    }
+    if (off + len > MAX_LEN) {
+      len = MAX_LEN - off;
+    }
+    for (i = 0; i < len; i++) {
+      wbuf[i] = (char)(round * 17 + i);
+    }
+    sfs_fseek(fd, SEEK_POS > copy_len ? 0 : SEEK_POS);
+    int64_t before = ofdt[fd].offset;
+
+    if (len > 0) {
+      if (sfs_pwrite(fd, wbuf, len, off) != len) {
+        error(round, "short sfs_pwrite");
+      }
+      memcpy(copy + off, wbuf, len);
+      if (off + len > copy_len) {
+        copy_len = off + len;
+      }
+    }
+    if (sfs_getfilesize("positional.bin") != copy_len) {
+      error(round, "wrong file size");
+    }
+
+    /* read anywhere, past the end included */
+    int roff = next(copy_len + 100);
+    int rlen = 1 + next(MAX_IO);
+    int expect = roff >= copy_len ? 0 : (roff + rlen > copy_len ? copy_len - roff : rlen);
+    memset(rbuf, 0, sizeof(rbuf));
+    if (sfs_pread(fd, rbuf, rlen, roff) != expect) {
+      error(round, "sfs_pread returned the wrong length");
+    } else if (memcmp(rbuf, copy + roff, expect) != 0) {
+      error(round, "sfs_pread returned the wrong data");
+    }
+    if (ofdt[fd].offset != before) {
+      error(round, "the file pointer moved");
+    }
+  }
+
+  /* offsets that cannot work change nothing */
+  if (sfs_pwrite(fd, wbuf, 10, copy_len + 1) >= 0) {
+    error(ROUNDS, "sfs_pwrite past the end of the file made a hole");
+  }
+  if (sfs_pwrite(fd, wbuf, 10, -1) >= 0 || sfs_pread(fd, rbuf, 10, -1) >= 0) {
+    error(ROUNDS, "a negative offset was accepted");
+  }
+  if (sfs_getfilesize("positional.bin") != copy_len) {
+    error(ROUNDS, "the file size changed");
+  }
+  check_whole(fd, "written");
+
+  /* a mapping is ended once, and only on a descriptor that has one */
+  sfs_extent_t ext[8];
+  int n = sfs_map(fd, 100, 3 * BLOCK_SIZE, 0, ext, 8);
+  if (n <= 0 || sfs_unmap(fd, ext, n, 0) != 0) {
+    error(ROUNDS, "mapping the file");
+  }
+  if (sfs_unmap(fd, ext, n, 0) >= 0 || sfs_unmap(-1, ext, 0, 0) >= 0 || sfs_unmap(fd + 1, ext, 0, 0) >= 0) {
+    error(ROUNDS, "sfs_unmap without a mapping was accepted");
+  }
+  if (sfs_pwrite(fd, wbuf, 10, 0) != 10) {      /* the file is not locked any more */
+    error(ROUNDS, "writing after sfs_unmap");
+  }
+  memcpy(copy, wbuf, 10);
+  check_whole(fd, "after a mapping");
+  sfs_fclose(fd);
+  if (sfs_pread(fd, rbuf, 10, 0) >= 0 || sfs_pwrite(fd, wbuf, 10, 0) >= 0) {
+    error(ROUNDS, "positional I/O on a closed file");
+  }
+
+  mksfs(0);
+  fd = sfs_fopen("positional.bin");
+  check_whole(fd, "after a remount");
+  sfs_fclose(fd);
+
+  printf("File of %d bytes after %d rounds\n", copy_len, ROUNDS);
+  printf("Test program exiting with %d errors\n", error_count);
+  free(copy);
+  return error_count;
+}
@@ -0,0 +1,166 @@
+/* sfs_test9.c
+ *
+ * Read-ahead test: a file larger than the buffer cache is read back
+ * after a remount (cold cache). Sequential reads must grow the window
+ * from READ_AHEAD_MIN to READ_AHEAD_MAX blocks and get most blocks
+ * from the read-ahead, a seek must reset it, the window must stop at
+ * the end of the file, and a block written after it was read ahead
+ * must be read back with its new data.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+#include "sfs.c"
+
+#define FILE_BLKS 600           /* more than the CACHE_SIZE frames */
+#define CHUNK 700               /* reads not aligned on blocks */
+
+static int error_count = 0;
+
+void red () {
+  printf("\033[1;31m");
+}
+
+void reset () {
+  printf("\033[0m");
+}
+
+void error(const char *what) {
+  red();
+  printf("ERROR: %s\n", what);
+  reset();
+  error_count++;
+}
+
+char pattern(int i) {
+  return (char)(i / 1024 * 3 + i % 1021);
+}
+
+/* Reads len bytes at the file pointer and checks them against the
+ * pattern (or 'w' in the rewritten range).
+ */
+void read_check(int fd, int64_t pos, int len, int64_t w_off, int w_len) {
+  char buf[CHUNK];
+  int i;
+
+  if (sfs_fread(fd, buf, len) != len) {
+    error("short read");
+    return;
+  }
+  for (i = 0; i < len; i++) {
+    int64_t at = pos + i;
+    char expect = at >= w_off && at < w_off + w_len ? 'w' : pattern((int)at);
+    if (buf[i] != expect) {
+      printf("byte %lld: ", (long long)at);
+      error("wrong data");
+      return;
+    }
+  }
+}
+
+int
+main()
+{
+  cache_stats_t before, after;
+  int64_t pos;
+  int fd, i, window, grew, max_seen;
+
+  mksfs(1);
+  int len = FILE_BLKS * BLOCK_SIZE - 300;
+  char *data = malloc(len);
+  for (i = 0; i < len; i++) {
+    data[i] = pattern(i);
+  }
+  fd = sfs_fopen("ahead.bin");
+  if (sfs_fwrite(fd, data, len) != len) {
+    error("writing the file");
+  }
+  sfs_fclose(fd);
+  mksfs(0);                     /* cold cache */
+
+  printf("Sequential reads\n");
+  fd = sfs_fopen("ahead.bin");
+  sfs_fseek(fd, 0);             /* opened at the end of the file */
+  cache_get_stats(&before);
+  window = 0;
+  grew = 0;
+  max_seen = 0;
+  for (pos = 0; pos < len / 2; pos += CHUNK) {
+    read_check(fd, pos, CHUNK, -1, 0);
+    ofdt_t *of = &ofdt[fd];
+    if (pos == 0 && of->ra_window != 2 * READ_AHEAD_MIN) {
+      error("the window did not start at READ_AHEAD_MIN blocks");
+    }
+    if (pos > 0 && of->ra_window != window && of->ra_window != 2 * window && of->ra_window != READ_AHEAD_MAX) {
+      error("the window did not double");
+    }
+    grew = grew + (of->ra_window > window);
+    window = of->ra_window;
+    max_seen = window > max_seen ? window : max_seen;
+    if (window > READ_AHEAD_MAX) {
+      error("the window went past READ_AHEAD_MAX");
+    }
+    if (of->ra_end <= (pos + CHUNK - 1) / BLOCK_SIZE) {
+      error("the read-ahead fell behind the reads");
+    }
+  }
+  cache_get_stats(&after);
+  if (max_seen != READ_AHEAD_MAX || grew < 4) {
+    error("the window never reached READ_AHEAD_MAX");
+  }
+  if (after.prefetched - before.prefetched < FILE_BLKS / 2 - 2 * READ_AHEAD_MAX) {
+    error("the blocks read were not read ahead");
+  }
+  if (after.misses - before.misses > READ_AHEAD_MAX) {
+    printf("%ld misses: ", after.misses - before.misses);
+    error("the sequential reads waited on the disk");
+  }
+
+  printf("A seek resets the window\n");
+  pos = len / 3 + 5;
+  sfs_fseek(fd, (int)pos);
+  read_check(fd, pos, CHUNK, -1, 0);
+  if (ofdt[fd].ra_window != 0) {
+    error("the window was not reset by the seek");
+  }
+  read_check(fd, pos + CHUNK, CHUNK, -1, 0);
+  if (ofdt[fd].ra_window != 2 * READ_AHEAD_MIN) {
+    error("the window did not start again at READ_AHEAD_MIN blocks");
+  }
+  if (sfs_pread(fd, data, CHUNK, 100) != CHUNK || ofdt[fd].ra_window != 0) {
+    error("the window was not reset by an sfs_pread elsewhere");
+  }
+
+  printf("Blocks rewritten after the read-ahead\n");
+  pos = (int64_t)(FILE_BLKS - 150) * BLOCK_SIZE;
+  sfs_fseek(fd, (int)pos);
+  for (i = 0; i < 12; i++) {    /* the window covers the next blocks */
+    read_check(fd, pos, CHUNK, -1, 0);
+    pos = pos + CHUNK;
+  }
+  int64_t w_off = (ofdt[fd].ra_end - 3) * (int64_t)BLOCK_SIZE + 10;
+  int w_len = 2 * BLOCK_SIZE;
+  if (w_off <= pos) {
+    error("nothing read ahead to rewrite");
+  }
+  memset(data, 'w', w_len);
+  if (sfs_pwrite(fd, data, w_len, w_off) != w_len) {
+    error("rewriting blocks read ahead");
+  }
+  while (pos + CHUNK <= len) {  /* up to the end of the file */
+    read_check(fd, pos, CHUNK, w_off, w_len);
+    pos = pos + CHUNK;
+    if (ofdt[fd].ra_end > FILE_BLKS) {
+      error("the read-ahead went past the end of the file");
+      break;
+    }
+  }
+  read_check(fd, pos, len - (int)pos, w_off, w_len);
+  sfs_fclose(fd);
+
+  printf("Test program exiting with %d errors\n", error_count);
+  free(data);
+  return error_count;
+}